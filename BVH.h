@@ -0,0 +1,702 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "ContentHash.h"
+#include "MathHeader.h"
+#include "MemoryUsage.h"
+#include "Profiler.h"
+#include "RayStream.h"
+#include "TraversalStats.h"
+
+// Axis aligned bounding box
+struct BBox
+{
+	Vec3f lo = Vec3f(kInfinity);
+	Vec3f hi = Vec3f(-kInfinity);
+
+	void Extend(const Vec3f &p)
+	{
+		lo = Vec3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi = Vec3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
+	void Extend(const BBox &b)
+	{
+		// an empty box would stretch this one to infinity
+		if (b.Empty()) return;
+		Extend(b.lo);
+		Extend(b.hi);
+	}
+	bool Empty() const { return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z; }
+	Vec3f Centroid() const { return (lo + hi) * 0.5f; }
+	float SurfaceArea() const
+	{
+		if (Empty()) return 0;
+		Vec3f d = hi - lo;
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	// Slab test against [0, tMax], invDir is 1 / direction
+	bool IntersectRay(const Vec3f &orig, const Vec3f &invDir, float tMax, float &tEntry) const
+	{
+		float t0 = 0, t1 = tMax;
+		for (uint8_t a = 0; a < 3; ++a)
+		{
+			float tNear = (lo[a] - orig[a]) * invDir[a];
+			float tFar = (hi[a] - orig[a]) * invDir[a];
+			if (tNear > tFar) std::swap(tNear, tFar);
+			t0 = tNear > t0 ? tNear : t0;
+			t1 = tFar < t1 ? tFar : t1;
+			if (t0 > t1) return false;
+		}
+		tEntry = t0;
+		return true;
+	}
+};
+
+// Flattened BVH node in depth first order. The first child of an inner node
+// directly follows it, the second child is at offset.
+struct BVHNode
+{
+	BBox bounds;
+	uint32_t offset; // leaf: first entry in BVH::triIndices, inner: index of the second child
+	uint32_t count;  // number of triangles in a leaf, 0 for inner nodes
+
+	bool IsLeaf() const { return count > 0; }
+};
+
+struct BVHBuildStats
+{
+	double buildMs = 0;
+	uint32_t numNodes = 0;
+	uint32_t numLeaves = 0;
+	uint32_t maxDepth = 0;
+	uint32_t numRefs = 0;          // triangle references in the leaves, more than the triangles with spatial splits
+	uint32_t numSpatialSplits = 0;
+};
+
+struct BVHBuildOptions
+{
+	uint32_t leafSize = 4;
+	// Let a split plane cut triangles in two (SBVH) where the object partition leaves the
+	// children overlapping and cutting is cheaper under the SAH
+	bool spatialSplits = false;
+	// Extra triangle references spatial splits may add, as a fraction of the triangles
+	float duplicationBudget = 0.3f;
+	// Spatial splits are only tried where the children of the best object split overlap
+	// by more than this fraction of the root surface area
+	float overlapThreshold = 1e-5f;
+	// Make every node of at most leafSize triangles a leaf instead of letting the SAH
+	// split it further, for leaves that are read as whole blocks (out-of-core meshes)
+	bool blockLeaves = false;
+};
+
+// Bounding volume hierarchy over the triangles of an indexed mesh, built with the
+// binned surface area heuristic. Triangles are partitioned by centroid (object
+// splits), and optionally also cut by split planes (spatial splits), in which case a
+// triangle can be referenced by more than one leaf.
+class BVH
+{
+	static const uint32_t kNumBins = 16;
+	static const uint32_t kStackSize = 64;
+	// Nodes this small are close to leaves, where cutting triangles rarely pays for the
+	// extra references
+	static const uint32_t kMinSpatialSplitRefs = 32;
+
+	struct BuildRef
+	{
+		BBox bounds; // the part of the triangle the reference covers
+		Vec3f centroid;
+		uint32_t triIndex;
+	};
+
+	// Best object partition of some references, children are the bins below and from bin
+	struct ObjectSplit
+	{
+		float cost = kInfinity; // left area * left count + right area * right count
+		uint8_t axis = 0;
+		uint32_t bin = 0;       // 0 when there is no split
+		float binLo = 0, binScale = 0;
+		BBox left, right;
+
+		uint32_t BinOf(const BuildRef &r) const
+		{
+			uint32_t b = uint32_t((r.centroid[axis] - binLo) * binScale);
+			return std::min(b, kNumBins - 1);
+		}
+	};
+
+	// Best split plane of the node bounds, references that straddle it go to both sides
+	struct SpatialSplit
+	{
+		float cost = kInfinity;
+		uint8_t axis = 0;
+		float position = 0;
+		uint32_t leftCount = 0, rightCount = 0;
+		BBox left, right;
+	};
+
+	uint32_t maxLeafSize = 4;
+	BVHBuildOptions buildOptions;
+	const Vec3f *buildPositions = nullptr;
+	const uint32_t *buildIndices = nullptr;
+	float rootArea = 0;
+	uint32_t maxRefs = 0;
+	uint32_t numBuildRefs = 0;
+
+	uint32_t MakeLeaf(std::vector<BuildRef> &refs, uint32_t start, uint32_t end, const BBox &bounds)
+	{
+		BVHNode node;
+		node.bounds = bounds;
+		node.offset = (uint32_t)triIndices.size();
+		node.count = end - start;
+		for (uint32_t i = start; i < end; ++i)
+			triIndices.push_back(refs[i].triIndex);
+		nodes.push_back(node);
+		stats.numLeaves++;
+		return (uint32_t)nodes.size() - 1;
+	}
+
+	// Binned SAH over the widest centroid axis, axis extent must be above 0
+	ObjectSplit FindObjectSplit(const BuildRef *refs, uint32_t count, const BBox &centroidBounds, uint8_t axis) const
+	{
+		ObjectSplit split;
+		split.axis = axis;
+		split.binLo = centroidBounds.lo[axis];
+		split.binScale = kNumBins / (centroidBounds.hi[axis] - centroidBounds.lo[axis]);
+		BBox binBounds[kNumBins];
+		uint32_t binCounts[kNumBins] = {};
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t b = split.BinOf(refs[i]);
+			binBounds[b].Extend(refs[i].bounds);
+			binCounts[b]++;
+		}
+		// sweep from the right to get the cost of every split plane
+		BBox rightBounds[kNumBins];
+		uint32_t rightCount[kNumBins];
+		BBox accum;
+		uint32_t accumCount = 0;
+		for (uint32_t b = kNumBins - 1; b > 0; --b)
+		{
+			accum.Extend(binBounds[b]);
+			accumCount += binCounts[b];
+			rightBounds[b] = accum;
+			rightCount[b] = accumCount;
+		}
+		accum = BBox();
+		accumCount = 0;
+		for (uint32_t b = 1; b < kNumBins; ++b)
+		{
+			accum.Extend(binBounds[b - 1]);
+			accumCount += binCounts[b - 1];
+			if (accumCount == 0 || rightCount[b] == 0) continue;
+			float cost = accum.SurfaceArea() * accumCount + rightBounds[b].SurfaceArea() * rightCount[b];
+			if (cost < split.cost)
+			{
+				split.cost = cost;
+				split.bin = b;
+				split.left = accum;
+				split.right = rightBounds[b];
+			}
+		}
+		return split;
+	}
+
+	// Bounds of the part of triangle tri between lo and hi along axis
+	BBox ClipTriangle(uint32_t tri, uint8_t axis, float lo, float hi) const
+	{
+		Vec3f v[3];
+		for (uint32_t k = 0; k < 3; ++k)
+			v[k] = buildPositions[buildIndices[tri * 3 + k]];
+		BBox clipped;
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			const Vec3f &a = v[k], &b = v[(k + 1) % 3];
+			if (a[axis] >= lo && a[axis] <= hi) clipped.Extend(a);
+			// points where the edge crosses the slab planes
+			for (float plane : { lo, hi })
+				if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+				{
+					float t = (plane - a[axis]) / (b[axis] - a[axis]);
+					Vec3f p = a + (b - a) * t;
+					p[axis] = plane;
+					clipped.Extend(p);
+				}
+		}
+		return clipped;
+	}
+
+	static BBox Intersection(const BBox &a, const BBox &b)
+	{
+		BBox r;
+		r.lo = Vec3f(std::max(a.lo.x, b.lo.x), std::max(a.lo.y, b.lo.y), std::max(a.lo.z, b.lo.z));
+		r.hi = Vec3f(std::min(a.hi.x, b.hi.x), std::min(a.hi.y, b.hi.y), std::min(a.hi.z, b.hi.z));
+		return r;
+	}
+
+	// Binned spatial split along the widest axis of the node bounds. Each reference is
+	// clipped to the bins it spans, and counted as entering its first and leaving its last.
+	SpatialSplit FindSpatialSplit(const std::vector<BuildRef> &refs, const BBox &bounds, uint8_t axis) const
+	{
+		SpatialSplit split;
+		Vec3f extent = bounds.hi - bounds.lo;
+		split.axis = axis;
+		if (extent[axis] <= 0) return split;
+		float binWidth = extent[axis] / kNumBins;
+		auto binOf = [&](float x) { return std::min(uint32_t(std::max(x - bounds.lo[axis], 0.0f) / binWidth), kNumBins - 1); };
+		auto binLo = [&](uint32_t b) { return bounds.lo[axis] + b * binWidth; };
+		BBox binBounds[kNumBins];
+		uint32_t entries[kNumBins] = {}, exits[kNumBins] = {};
+		for (const BuildRef &r : refs)
+		{
+			uint32_t first = binOf(r.bounds.lo[axis]), last = binOf(r.bounds.hi[axis]);
+			entries[first]++;
+			exits[last]++;
+			if (first == last)
+			{
+				binBounds[first].Extend(r.bounds);
+				continue;
+			}
+			for (uint32_t b = first; b <= last; ++b)
+			{
+				float lo = b == first ? r.bounds.lo[axis] : binLo(b);
+				float hi = b == last ? r.bounds.hi[axis] : binLo(b + 1);
+				binBounds[b].Extend(Intersection(ClipTriangle(r.triIndex, axis, lo, hi), r.bounds));
+			}
+		}
+		BBox rightBounds[kNumBins];
+		uint32_t rightCount[kNumBins];
+		BBox accum;
+		uint32_t accumCount = 0;
+		for (uint32_t b = kNumBins - 1; b > 0; --b)
+		{
+			accum.Extend(binBounds[b]);
+			accumCount += exits[b];
+			rightBounds[b] = accum;
+			rightCount[b] = accumCount;
+		}
+		accum = BBox();
+		accumCount = 0;
+		for (uint32_t b = 1; b < kNumBins; ++b)
+		{
+			accum.Extend(binBounds[b - 1]);
+			accumCount += entries[b - 1];
+			if (accumCount == 0 || rightCount[b] == 0) continue;
+			float cost = accum.SurfaceArea() * accumCount + rightBounds[b].SurfaceArea() * rightCount[b];
+			if (cost < split.cost)
+			{
+				split.cost = cost;
+				split.position = binLo(b);
+				split.leftCount = accumCount;
+				split.rightCount = rightCount[b];
+				split.left = accum;
+				split.right = rightBounds[b];
+			}
+		}
+		return split;
+	}
+
+	uint32_t BuildRecursive(std::vector<BuildRef> &refs, uint32_t start, uint32_t end, uint32_t depth)
+	{
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+		BBox bounds, centroidBounds;
+		for (uint32_t i = start; i < end; ++i)
+		{
+			bounds.Extend(refs[i].bounds);
+			centroidBounds.Extend(refs[i].centroid);
+		}
+		uint32_t count = end - start;
+		if (count <= 1 || depth + 1 >= kStackSize || (buildOptions.blockLeaves && count <= maxLeafSize))
+			return MakeLeaf(refs, start, end, bounds);
+
+		Vec3f extent = centroidBounds.hi - centroidBounds.lo;
+		uint8_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		if (extent[axis] <= 0)
+			return count <= maxLeafSize ? MakeLeaf(refs, start, end, bounds) : SplitMiddle(refs, start, end, bounds, depth);
+
+		ObjectSplit split = FindObjectSplit(&refs[start], count, centroidBounds, axis);
+		// cost relative to the parent, traversal step = 1, triangle test = 1
+		float leafCost = (float)count;
+		float splitCost = 1 + split.cost / bounds.SurfaceArea();
+		if (split.bin == 0 || (count <= maxLeafSize && leafCost <= splitCost))
+		{
+			if (count <= maxLeafSize) return MakeLeaf(refs, start, end, bounds);
+			return SplitMiddle(refs, start, end, bounds, depth);
+		}
+
+		BuildRef *mid = std::partition(&refs[start], &refs[0] + end, [&](const BuildRef &r) { return split.BinOf(r) < split.bin; });
+		return MakeInner(refs, start, uint32_t(mid - &refs[0]), end, bounds, depth);
+	}
+
+	// Fallback when SAH finds no useful plane but the node is too big for a leaf
+	uint32_t SplitMiddle(std::vector<BuildRef> &refs, uint32_t start, uint32_t end, const BBox &bounds, uint32_t depth)
+	{
+		return MakeInner(refs, start, start + (end - start) / 2, end, bounds, depth);
+	}
+
+	uint32_t MakeInner(std::vector<BuildRef> &refs, uint32_t start, uint32_t mid, uint32_t end, const BBox &bounds, uint32_t depth)
+	{
+		uint32_t index = (uint32_t)nodes.size();
+		BVHNode node;
+		node.bounds = bounds;
+		node.count = 0;
+		nodes.push_back(node);
+		BuildRecursive(refs, start, mid, depth + 1);
+		nodes[index].offset = BuildRecursive(refs, mid, end, depth + 1);
+		return index;
+	}
+
+	// Like BuildRecursive, but every node owns its references since spatial splits add more
+	uint32_t BuildSpatialRecursive(std::vector<BuildRef> &&refs, uint32_t depth)
+	{
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+		BBox bounds, centroidBounds;
+		for (const BuildRef &r : refs)
+		{
+			bounds.Extend(r.bounds);
+			centroidBounds.Extend(r.centroid);
+		}
+		uint32_t count = (uint32_t)refs.size();
+		if (count <= 1 || depth + 1 >= kStackSize || (buildOptions.blockLeaves && count <= maxLeafSize))
+			return MakeLeaf(refs, 0, count, bounds);
+
+		Vec3f extent = centroidBounds.hi - centroidBounds.lo;
+		uint8_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		ObjectSplit objectSplit;
+		if (extent[axis] > 0)
+			objectSplit = FindObjectSplit(refs.data(), count, centroidBounds, axis);
+		// cutting triangles only pays where the object split leaves the children overlapping
+		SpatialSplit spatialSplit;
+		bool overlapping = objectSplit.bin == 0 ||
+			Intersection(objectSplit.left, objectSplit.right).SurfaceArea() > buildOptions.overlapThreshold * rootArea;
+		if (overlapping && numBuildRefs < maxRefs && count > kMinSpatialSplitRefs)
+		{
+			for (uint8_t a = 0; a < 3; ++a)
+			{
+				SpatialSplit candidate = FindSpatialSplit(refs, bounds, a);
+				if (candidate.cost < spatialSplit.cost) spatialSplit = candidate;
+			}
+		}
+		bool spatial = spatialSplit.cost < objectSplit.cost &&
+			numBuildRefs + spatialSplit.leftCount + spatialSplit.rightCount - count <= maxRefs;
+		float bestCost = spatial ? spatialSplit.cost : objectSplit.cost;
+
+		float leafCost = (float)count;
+		float splitCost = 1 + bestCost / bounds.SurfaceArea();
+		std::vector<BuildRef> left, right;
+		if (!spatial && (objectSplit.bin == 0 || (count <= maxLeafSize && leafCost <= splitCost)))
+		{
+			if (count <= maxLeafSize) return MakeLeaf(refs, 0, count, bounds);
+			left.assign(refs.begin(), refs.begin() + count / 2);
+			right.assign(refs.begin() + count / 2, refs.end());
+		}
+		else if (spatial && count <= maxLeafSize && leafCost <= splitCost)
+			return MakeLeaf(refs, 0, count, bounds);
+		else if (spatial)
+		{
+			stats.numSpatialSplits++;
+			uint8_t a = spatialSplit.axis;
+			float position = spatialSplit.position;
+			float leftArea = spatialSplit.left.SurfaceArea(), rightArea = spatialSplit.right.SurfaceArea();
+			uint32_t leftCount = spatialSplit.leftCount, rightCount = spatialSplit.rightCount;
+			for (const BuildRef &r : refs)
+			{
+				if (r.bounds.hi[a] <= position)
+				{
+					left.push_back(r);
+					continue;
+				}
+				if (r.bounds.lo[a] >= position)
+				{
+					right.push_back(r);
+					continue;
+				}
+				// a straddling reference may go whole to one side when that is cheaper than splitting it
+				BBox withLeft = spatialSplit.left, withRight = spatialSplit.right;
+				withLeft.Extend(r.bounds);
+				withRight.Extend(r.bounds);
+				float splitRef = leftArea * leftCount + rightArea * rightCount;
+				float toLeft = withLeft.SurfaceArea() * leftCount + rightArea * (rightCount - 1);
+				float toRight = leftArea * (leftCount - 1) + withRight.SurfaceArea() * rightCount;
+				if (toLeft < splitRef && toLeft <= toRight)
+				{
+					left.push_back(r);
+					rightCount--;
+					continue;
+				}
+				if (toRight < splitRef)
+				{
+					right.push_back(r);
+					leftCount--;
+					continue;
+				}
+				BuildRef l = r, h = r;
+				l.bounds = Intersection(ClipTriangle(r.triIndex, a, r.bounds.lo[a], position), r.bounds);
+				h.bounds = Intersection(ClipTriangle(r.triIndex, a, position, r.bounds.hi[a]), r.bounds);
+				l.centroid = l.bounds.Centroid();
+				h.centroid = h.bounds.Centroid();
+				// a triangle that only touches the plane within rounding stays on one side
+				if (!l.bounds.Empty()) left.push_back(l);
+				if (!h.bounds.Empty()) right.push_back(h);
+				if (!l.bounds.Empty() && !h.bounds.Empty())
+					numBuildRefs++;
+				else if (l.bounds.Empty() && h.bounds.Empty())
+					left.push_back(r);
+			}
+			// clipping can round a sliver down to nothing on one side
+			if (left.empty() || right.empty())
+			{
+				std::vector<BuildRef> &all = left.empty() ? right : left;
+				left.assign(all.begin(), all.begin() + all.size() / 2);
+				right.assign(all.begin() + all.size() / 2, all.end());
+			}
+		}
+		else
+		{
+			for (const BuildRef &r : refs)
+				(objectSplit.BinOf(r) < objectSplit.bin ? left : right).push_back(r);
+		}
+		std::vector<BuildRef>().swap(refs);
+
+		uint32_t index = (uint32_t)nodes.size();
+		BVHNode node;
+		node.bounds = bounds;
+		node.count = 0;
+		nodes.push_back(node);
+		BuildSpatialRecursive(std::move(left), depth + 1);
+		nodes[index].offset = BuildSpatialRecursive(std::move(right), depth + 1);
+		return index;
+	}
+
+public:
+	std::vector<BVHNode> nodes;
+	// triangle indices referenced by the leaves, in leaf order
+	std::vector<uint32_t> triIndices;
+	BVHBuildStats stats;
+
+	bool Empty() const { return nodes.empty(); }
+
+	uint64_t Bytes() const { return nodes.capacity() * sizeof(BVHNode) + triIndices.capacity() * sizeof(uint32_t); }
+
+	// Check nodes read from a file before traversing them: children come after their
+	// parent and inside the node array, no path is deeper than the traversal stack, and
+	// leaves reference entries [0, numRefs) of whatever they index
+	bool NodesValid(uint64_t numRefs) const
+	{
+		std::vector<uint32_t> depth(nodes.size(), 0);
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			const BVHNode &node = nodes[i];
+			if (node.IsLeaf())
+			{
+				if (uint64_t(node.offset) + node.count > numRefs) return false;
+				continue;
+			}
+			if (node.offset <= i + 1 || node.offset >= nodes.size() || depth[i] + 1 >= kStackSize) return false;
+			depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+			depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+		}
+		return true;
+	}
+
+	// Hash of everything besides the triangles that decides what Build makes, for caches
+	// of built BVHs: the options field by field, the builder constants and the node layout
+	static uint64_t HashBuildSettings(const BVHBuildOptions &options, uint64_t hash)
+	{
+		const uint32_t constants[] = { kNumBins, kStackSize, kMinSpatialSplitRefs, (uint32_t)sizeof(BVHNode) };
+		hash = HashBytes(constants, sizeof(constants), hash);
+		hash = HashBytes(&options.leafSize, sizeof(options.leafSize), hash);
+		hash = HashBytes(&options.spatialSplits, sizeof(options.spatialSplits), hash);
+		hash = HashBytes(&options.duplicationBudget, sizeof(options.duplicationBudget), hash);
+		hash = HashBytes(&options.overlapThreshold, sizeof(options.overlapThreshold), hash);
+		return HashBytes(&options.blockLeaves, sizeof(options.blockLeaves), hash);
+	}
+
+	void Build(const Vec3f *positions, const uint32_t *indices, uint32_t numTris, uint32_t leafSize = 4)
+	{
+		BVHBuildOptions options;
+		options.leafSize = leafSize;
+		Build(positions, indices, numTris, options);
+	}
+
+	void Build(const Vec3f *positions, const uint32_t *indices, uint32_t numTris, const BVHBuildOptions &options)
+	{
+		PROFILE_SCOPE("BuildBVH", numTris);
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		nodes.clear();
+		triIndices.clear();
+		stats = BVHBuildStats();
+		maxLeafSize = options.leafSize;
+		buildOptions = options;
+		if (numTris == 0) return;
+		std::vector<BuildRef> refs(numTris);
+		BBox rootBounds;
+		for (uint32_t i = 0; i < numTris; ++i)
+		{
+			for (uint32_t k = 0; k < 3; ++k)
+				refs[i].bounds.Extend(positions[indices[i * 3 + k]]);
+			refs[i].centroid = refs[i].bounds.Centroid();
+			refs[i].triIndex = i;
+			rootBounds.Extend(refs[i].bounds);
+		}
+		nodes.reserve(2 * numTris);
+		triIndices.reserve(numTris);
+		if (options.spatialSplits)
+		{
+			buildPositions = positions;
+			buildIndices = indices;
+			rootArea = rootBounds.SurfaceArea();
+			numBuildRefs = numTris;
+			maxRefs = numTris + uint32_t(numTris * std::max(0.0f, options.duplicationBudget));
+			BuildSpatialRecursive(std::move(refs), 0);
+			buildPositions = nullptr;
+			buildIndices = nullptr;
+		}
+		else
+			BuildRecursive(refs, 0, numTris, 0);
+		// the node reservation is the worst case, usually about twice what is used
+		nodes.shrink_to_fit();
+		triIndices.shrink_to_fit();
+		stats.numNodes = (uint32_t)nodes.size();
+		stats.numRefs = (uint32_t)triIndices.size();
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		stats.buildMs = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+	}
+
+	// Expected cost of a random ray under the SAH model (1 per node visit, 1 per triangle test)
+	float SahCost() const
+	{
+		if (nodes.empty()) return 0;
+		float rootArea = nodes[0].bounds.SurfaceArea();
+		if (rootArea <= 0) return 0;
+		float cost = 0;
+		for (const BVHNode &node : nodes)
+			cost += node.bounds.SurfaceArea() / rootArea * (node.IsLeaf() ? node.count : 1);
+		return cost;
+	}
+
+	// Visit the leaves hit by the ray, nearest first. leaf(first, count, tMax) tests the
+	// triangles triIndices[first..first+count) and shrinks tMax when it finds a closer hit.
+	template<typename LeafFn>
+	void Traverse(const Vec3f &orig, const Vec3f &dir, float &tMax, LeafFn leaf) const
+	{
+		if (nodes.empty()) return;
+		Vec3f invDir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+		uint32_t stack[kStackSize];
+		uint32_t stackSize = 0;
+		float tEntry;
+		if (!nodes[0].bounds.IntersectRay(orig, invDir, tMax, tEntry)) return;
+		stack[stackSize++] = 0;
+		while (stackSize > 0)
+		{
+			const BVHNode &node = nodes[stack[--stackSize]];
+			if (node.IsLeaf())
+			{
+				leaf(node.offset, node.count, tMax);
+				continue;
+			}
+			uint32_t first = uint32_t(&node - &nodes[0]) + 1, second = node.offset;
+			float t0, t1;
+			bool hit0 = nodes[first].bounds.IntersectRay(orig, invDir, tMax, t0);
+			bool hit1 = nodes[second].bounds.IntersectRay(orig, invDir, tMax, t1);
+			// push the farther child first so the nearer one is visited next
+			if (hit0 && hit1)
+			{
+				if (t0 < t1) std::swap(first, second);
+				stack[stackSize++] = first;
+				stack[stackSize++] = second;
+			}
+			else if (hit0) stack[stackSize++] = first;
+			else if (hit1) stack[stackSize++] = second;
+		}
+	}
+
+	// Visit the leaves hit by any ray of a stream. Each node is fetched once for all the
+	// rays that reach it, which go along with it on the stack. leaf(first, count, active,
+	// numActive) tests the triangles triIndices[first..first+count) against the rays
+	// active[0..numActive) and lowers their tMax when it finds closer hits.
+	template<typename LeafFn>
+	void TraverseStream(const RayStream &rays, LeafFn leaf) const
+	{
+		if (nodes.empty() || rays.count == 0) return;
+		float ix[kRayStreamSize], iy[kRayStreamSize], iz[kRayStreamSize];
+		for (uint32_t i = 0; i < rays.count; ++i)
+		{
+			ix[i] = 1 / rays.dx[i];
+			iy[i] = 1 / rays.dy[i];
+			iz[i] = 1 / rays.dz[i];
+		}
+		// keep the rays of in that hit bounds in out, returns how many and the nearest entry
+		auto cull = [&](const BBox &b, const uint32_t *in, uint32_t n, uint32_t *out, float &nearest) {
+			uint32_t numHit = 0;
+			nearest = kInfinity;
+			for (uint32_t k = 0; k < n; ++k)
+			{
+				uint32_t r = in[k];
+				float t0 = rays.tMin[r], t1 = rays.tMax[r];
+				float tNear = (b.lo.x - rays.ox[r]) * ix[r], tFar = (b.hi.x - rays.ox[r]) * ix[r];
+				if (tNear > tFar) std::swap(tNear, tFar);
+				t0 = tNear > t0 ? tNear : t0;
+				t1 = tFar < t1 ? tFar : t1;
+				tNear = (b.lo.y - rays.oy[r]) * iy[r], tFar = (b.hi.y - rays.oy[r]) * iy[r];
+				if (tNear > tFar) std::swap(tNear, tFar);
+				t0 = tNear > t0 ? tNear : t0;
+				t1 = tFar < t1 ? tFar : t1;
+				tNear = (b.lo.z - rays.oz[r]) * iz[r], tFar = (b.hi.z - rays.oz[r]) * iz[r];
+				if (tNear > tFar) std::swap(tNear, tFar);
+				t0 = tNear > t0 ? tNear : t0;
+				t1 = tFar < t1 ? tFar : t1;
+				if (t0 > t1) continue;
+				out[numHit++] = r;
+				nearest = std::min(nearest, t0);
+			}
+			return numHit;
+		};
+
+		uint32_t stack[kStackSize], stackCounts[kStackSize];
+		uint32_t stackRays[kStackSize][kRayStreamSize];
+		uint32_t stackSize = 0;
+		uint32_t active[kRayStreamSize], hit0[kRayStreamSize], hit1[kRayStreamSize];
+		for (uint32_t i = 0; i < rays.count; ++i)
+			active[i] = i;
+		float t0, t1;
+		stackCounts[0] = cull(nodes[0].bounds, active, rays.count, stackRays[0], t0);
+		if (stackCounts[0] == 0) return;
+		stack[stackSize++] = 0;
+		while (stackSize > 0)
+		{
+			--stackSize;
+			const BVHNode &node = nodes[stack[stackSize]];
+			uint32_t numActive = stackCounts[stackSize];
+			std::copy(stackRays[stackSize], stackRays[stackSize] + numActive, active);
+			if (node.IsLeaf())
+			{
+				leaf(node.offset, node.count, active, numActive);
+				continue;
+			}
+			uint32_t first = uint32_t(&node - &nodes[0]) + 1, second = node.offset;
+			uint32_t n0 = cull(nodes[first].bounds, active, numActive, hit0, t0);
+			uint32_t n1 = cull(nodes[second].bounds, active, numActive, hit1, t1);
+			// push the child the rays enter farther along first so the nearer one is visited next
+			auto push = [&](uint32_t child, const uint32_t *childRays, uint32_t n) {
+				if (n == 0) return;
+				std::copy(childRays, childRays + n, stackRays[stackSize]);
+				stackCounts[stackSize] = n;
+				stack[stackSize++] = child;
+			};
+			if (t0 < t1)
+			{
+				push(second, hit1, n1);
+				push(first, hit0, n0);
+			}
+			else
+			{
+				push(first, hit0, n0);
+				push(second, hit1, n1);
+			}
+		}
+	}
+};
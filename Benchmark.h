@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+#include "MathHeader.h"
+
+// Time fn over a number of repetitions and return the best run in milliseconds
+template<typename F>
+double BestOfMilliseconds(uint32_t repetitions, F fn)
+{
+	double best = kInfinity;
+	for (uint32_t r = 0; r < repetitions; ++r)
+	{
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		fn();
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::milli>(timeEnd - timeStart).count());
+	}
+	return best;
+}
+
+inline float MaxDifference(const Vec3f *a, const Vec3f *b, uint32_t count)
+{
+	float diff = 0;
+	for (uint32_t i = 0; i < count; ++i)
+		diff = std::max(diff, (a[i] - b[i]).Length());
+	return diff;
+}
+
+inline void ReportBenchmark(const char *name, double genericMs, double batchedMs, float maxDiff)
+{
+	fprintf(stderr, "%-28s generic %8.3f ms  batched %8.3f ms  speedup %5.2fx  max diff %g\n",
+		name, genericMs, batchedMs, genericMs / batchedMs, maxDiff);
+}
+
+// Compare the SIMD camera ray path against the generic Vec3/Matrix4x4 templates. Only
+// generating the direction rows is timed, not tracing or shading, so the speedup is not
+// a frame time speedup; a render reports its own frame time.
+void RunMathBenchmarks()
+{
+	const uint32_t width = 1920, height = 64;
+	const uint32_t repetitions = 10;
+
+	Matrix4x4f m(
+		0.707107f, -0.331295f, 0.624695f, 0,
+		0, 0.883452f, 0.468521f, 0,
+		-0.707107f, -0.331295f, 0.624695f, 0,
+		-1.63871f, -5.747777f, -40.400412f, 1);
+
+#if USE_AVX
+	fprintf(stderr, "SIMD backend: AVX\n");
+#elif USE_SSE
+	fprintf(stderr, "SIMD backend: SSE\n");
+#else
+	fprintf(stderr, "SIMD backend: none (generic fallback)\n");
+#endif
+
+	// camera ray rows, as in Render
+	std::unique_ptr<float[]> xs(new float[width]);
+	for (uint32_t i = 0; i < width; ++i)
+		xs[i] = 2 * (i + 0.5f) / width - 1;
+	std::unique_ptr<Vec3f[]> rowGeneric(new Vec3f[width * height]);
+	std::unique_ptr<Vec3f[]> rowBatched(new Vec3f[width * height]);
+	double genericMs = BestOfMilliseconds(repetitions, [&]() {
+		for (uint32_t j = 0; j < height; ++j)
+			GenerateRayDirectionsGeneric(m, xs.get(), 1 - 2 * (j + 0.5f) / height, width, &rowGeneric[j * width]);
+	});
+	double batchedMs = BestOfMilliseconds(repetitions, [&]() {
+		for (uint32_t j = 0; j < height; ++j)
+			GenerateRayDirections(m, xs.get(), 1 - 2 * (j + 0.5f) / height, width, &rowBatched[j * width]);
+	});
+	ReportBenchmark("Camera ray rows 1920x64", genericMs, batchedMs, MaxDifference(rowGeneric.get(), rowBatched.get(), width * height));
+	fprintf(stderr, "(ray direction generation only, tracing and shading are not included)\n");
+}
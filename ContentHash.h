@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// 64 bit FNV-1a, used to key scene data by content
+inline uint64_t HashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+inline uint64_t HashString(const std::string &s, uint64_t hash = 14695981039346656037ull)
+{
+	return HashBytes(s.data(), s.size(), hash);
+}
+
+// Hash of a file's contents, false if it cannot be read
+inline bool HashFile(const std::string &path, uint64_t &hash)
+{
+	std::ifstream ifs(path, std::ios::binary);
+	if (ifs.fail()) return false;
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	hash = HashString(ss.str(), hash);
+	return true;
+}
@@ -1,10 +1,12 @@
 #pragma once
 
 #include "MathHeader.h"
+#include "Profiler.h"
 #include "TriangleMesh.h"
 
 TriangleMesh* generatePolySphere(const Matrix4x4f &o2w, float radius, uint32_t divisions)
 {
+	PROFILE_SCOPE("GenerateSphere");
 	// generate points
 	uint32_t numVertices = (divisions - 1) * divisions + 2;
 	std::unique_ptr<Vec3f[]> positions(new Vec3f[numVertices]);
@@ -82,11 +84,21 @@ TriangleMesh* generatePolySphere(const Matrix4x4f &o2w, float radius, uint32_t d
 		vIdx = numV;
 	}
 
-	return new TriangleMesh(o2w, numPolys, faceIndex, vertexIndex, positions, normals, texCoords);
+	// the mesh reads normals and texture coordinates per face vertex, not per vertex
+	std::unique_ptr<Vec3f[]> faceVertexNormals(new Vec3f[l]);
+	std::unique_ptr<Vec2f[]> faceVertexTexCoords(new Vec2f[l]);
+	for (uint32_t i = 0; i < l; i++)
+	{
+		faceVertexNormals[i] = normals[vertexIndex[i]];
+		faceVertexTexCoords[i] = texCoords[vertexIndex[i]];
+	}
+
+	return new TriangleMesh(o2w, numPolys, faceIndex, vertexIndex, positions, faceVertexNormals, faceVertexTexCoords);
 }
 
 TriangleMesh* loadPolyMeshFromFile(const Matrix4x4f &o2w, const char *file)
 {
+	PROFILE_SCOPE("LoadMesh");
 	std::ifstream ifs;
 	try
 	{
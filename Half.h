@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// IEEE 754 binary16 conversion, used to halve the size of intermediate pixel storage
+
+// Round to nearest even, overflow goes to infinity, values below the half range flush through denormals to 0
+inline uint16_t FloatToHalf(float value)
+{
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	uint32_t sign = (f >> 16) & 0x8000;
+	uint32_t exponent = (f >> 23) & 0xff;
+	uint32_t mantissa = f & 0x7fffff;
+
+	if (exponent == 0xff) // inf or nan
+		return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	int32_t e = int32_t(exponent) - 127 + 15;
+	if (e >= 0x1f) // overflow
+		return uint16_t(sign | 0x7c00);
+	if (e <= 0)
+	{
+		// denormal half, or zero
+		if (e < -10) return uint16_t(sign);
+		mantissa |= 0x800000;
+		uint32_t shift = uint32_t(14 - e);
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1))) half++;
+		return uint16_t(sign | half);
+	}
+	uint32_t half = sign | (uint32_t(e) << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	// a carry out of the mantissa correctly bumps the exponent
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+	return uint16_t(half);
+}
+
+inline float HalfToFloat(uint16_t h)
+{
+	uint32_t sign = uint32_t(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t f;
+	if (exponent == 0)
+	{
+		if (mantissa == 0)
+			f = sign;
+		else
+		{
+			// normalize the denormal
+			exponent = 127 - 15 + 1;
+			while ((mantissa & 0x400) == 0)
+			{
+				mantissa <<= 1;
+				exponent--;
+			}
+			f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+	}
+	else if (exponent == 0x1f)
+		f = sign | 0x7f800000 | (mantissa << 13);
+	else
+		f = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	float value;
+	memcpy(&value, &f, sizeof(value));
+	return value;
+}
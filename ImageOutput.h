@@ -0,0 +1,116 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Half.h"
+#include "MathHeader.h"
+
+// Pixel storage for a band of rows, either full floats or half floats
+class BandBuffer
+{
+	uint32_t width;
+	uint32_t height;
+	std::unique_ptr<Vec3f[]> floats;
+	std::unique_ptr<uint16_t[]> halves;
+
+public:
+	BandBuffer(uint32_t w, uint32_t h, bool halfFloat) : width(w), height(h)
+	{
+		if (halfFloat)
+			halves = std::unique_ptr<uint16_t[]>(new uint16_t[size_t(w) * h * 3]);
+		else
+			floats = std::unique_ptr<Vec3f[]>(new Vec3f[size_t(w) * h]);
+	}
+
+	void Set(uint32_t x, uint32_t y, const Vec3f &c)
+	{
+		size_t i = size_t(y) * width + x;
+		if (floats)
+			floats[i] = c;
+		else
+		{
+			halves[i * 3] = FloatToHalf(c.x);
+			halves[i * 3 + 1] = FloatToHalf(c.y);
+			halves[i * 3 + 2] = FloatToHalf(c.z);
+		}
+	}
+
+	Vec3f Get(uint32_t x, uint32_t y) const
+	{
+		size_t i = size_t(y) * width + x;
+		if (floats) return floats[i];
+		return Vec3f(HalfToFloat(halves[i * 3]), HalfToFloat(halves[i * 3 + 1]), HalfToFloat(halves[i * 3 + 2]));
+	}
+
+	uint32_t Width() const { return width; }
+	uint32_t Height() const { return height; }
+	size_t Bytes() const { return Bytes(width, height, !floats); }
+	static size_t Bytes(uint32_t w, uint32_t h, bool halfFloat)
+	{
+		return halfFloat ? size_t(w) * h * 3 * sizeof(uint16_t) : size_t(w) * h * sizeof(Vec3f);
+	}
+};
+
+// Binary PPM written one band of rows at a time, top to bottom
+class PpmWriter
+{
+	std::ofstream ofs;
+	std::vector<char> row;
+	uint32_t width = 0;
+
+public:
+	bool Open(const std::string &path, uint32_t w, uint32_t h)
+	{
+		ofs.open(path, std::ios::binary);
+		if (ofs.fail()) return false;
+		width = w;
+		row.resize(size_t(w) * 3);
+		ofs << "P6\n" << w << " " << h << "\n255\n";
+		return true;
+	}
+
+	// Quantize numRows rows, pixel(i, j) returning the color of column i in row j, and append them
+	template<typename F>
+	void WriteRows(uint32_t numRows, F pixel)
+	{
+		for (uint32_t j = 0; j < numRows; ++j)
+		{
+			for (uint32_t i = 0; i < width; ++i)
+			{
+				Vec3f c = pixel(i, j);
+				row[i * 3] = (char)(255 * clamp(0, 1, c.x));
+				row[i * 3 + 1] = (char)(255 * clamp(0, 1, c.y));
+				row[i * 3 + 2] = (char)(255 * clamp(0, 1, c.z));
+			}
+			ofs.write(row.data(), row.size());
+		}
+	}
+
+	void WriteRows(const BandBuffer &band, uint32_t numRows)
+	{
+		WriteRows(numRows, [&](uint32_t i, uint32_t j) { return band.Get(i, j); });
+	}
+
+	void WriteRows(const Vec3f *pixels, uint32_t numRows)
+	{
+		WriteRows(numRows, [&](uint32_t i, uint32_t j) { return pixels[size_t(j) * width + i]; });
+	}
+
+	bool Close()
+	{
+		ofs.close();
+		return !ofs.fail();
+	}
+};
+
+// Output file name for a frame, options.outputName + ".%04d.ppm"
+inline std::string FrameFileName(const std::string &outputName, uint32_t frame)
+{
+	std::string outputFile = outputName + ".%04d.ppm";
+	char buff[256];
+	sprintf_s(buff, outputFile.c_str(), frame);
+	return buff;
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+#include "Raytracer.h"
+
+// Pixels [x0, x1) x [y0, y1) of the frame
+struct ScreenRect
+{
+	uint32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+	bool Empty() const { return x0 >= x1 || y0 >= y1; }
+	uint64_t Area() const { return Empty() ? 0 : uint64_t(x1 - x0) * (y1 - y0); }
+
+	void Add(uint32_t x, uint32_t y)
+	{
+		if (Empty())
+		{
+			x0 = x; y0 = y; x1 = x + 1; y1 = y + 1;
+			return;
+		}
+		x0 = std::min(x0, x); y0 = std::min(y0, y);
+		x1 = std::max(x1, x + 1); y1 = std::max(y1, y + 1);
+	}
+
+	void Add(const ScreenRect &r)
+	{
+		if (r.Empty()) return;
+		if (Empty())
+		{
+			*this = r;
+			return;
+		}
+		x0 = std::min(x0, r.x0); y0 = std::min(y0, r.y0);
+		x1 = std::max(x1, r.x1); y1 = std::max(y1, r.y1);
+	}
+};
+
+struct IncrementalStats
+{
+	uint64_t pixels = 0;
+	uint64_t retraced = 0;
+	uint64_t previouslyCovered = 0; // pixels that hit a changed object in the previous render
+	uint64_t projected = 0;         // pixels inside the new projected bounds of the changed objects
+	double ms = 0;
+
+	double RetracedFraction() const { return pixels ? retraced / double(pixels) : 0; }
+};
+
+// The last rendered frame kept whole, with the object every pixel hit and the screen
+// rectangle every object covered. Shading only depends on the primary hit, so when
+// some objects change and the camera does not, the only pixels that can change are
+// the ones that saw those objects before and the ones inside their new projected
+// bounds. Only those are retraced, the rest of the frame is kept as is.
+class IncrementalRenderer
+{
+	static const uint32_t kNoObject = UINT32_MAX;
+
+	uint32_t width = 0, height = 0;
+	Matrix4x4f cameraToWorld;
+	float fov = 0;
+	Vec3f backgroundColor;
+	std::vector<Vec3f> colors;
+	std::vector<uint32_t> objectIds;     // index into the objects, kNoObject where the ray missed
+	std::vector<ScreenRect> objectRects; // covers every pixel of the object, may be larger
+	std::vector<uint8_t> dirty;
+
+	bool Matches(const Options &options, const std::vector<std::unique_ptr<Object>> &objects) const
+	{
+		if (options.width != width || options.height != height || options.fov != fov || objects.size() < objectRects.size())
+			return false;
+		for (uint8_t i = 0; i < 3; ++i)
+			if (options.backgroundColor[i] != backgroundColor[i]) return false;
+		for (uint8_t r = 0; r < 4; ++r)
+			for (uint8_t c = 0; c < 4; ++c)
+				if (options.cameraToWorld[r][c] != cameraToWorld[r][c]) return false;
+		return true;
+	}
+
+	// Pixels the world bounds of an object can cover, the whole frame when the object has
+	// no bounds or they reach behind the eye
+	ScreenRect ProjectBounds(const Options &options, const PrimaryRays &rays, const Object &object) const
+	{
+		ScreenRect whole;
+		whole.x1 = width;
+		whole.y1 = height;
+		Vec3f lo, hi;
+		if (!object.GetWorldBounds(lo, hi)) return whole;
+		Matrix4x4f worldToCamera = options.cameraToWorld.Inverse();
+		float aspectScale = options.width / (float)options.height * rays.scale;
+		float xMin = kInfinity, yMin = kInfinity, xMax = -kInfinity, yMax = -kInfinity;
+		for (uint32_t k = 0; k < 8; ++k)
+		{
+			Vec3f corner(k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z), c;
+			worldToCamera.MultPointVec(corner, c);
+			float z = -c.z;
+			if (z <= 0) return whole;
+			// inverse of the pixel to camera mapping of PrimaryRays
+			float x = (c.x / z / aspectScale + 1) * 0.5f * width;
+			float y = (1 - c.y / z / rays.scale) * 0.5f * height;
+			xMin = std::min(xMin, x); xMax = std::max(xMax, x);
+			yMin = std::min(yMin, y); yMax = std::max(yMax, y);
+		}
+		// a pixel is in when its center ray can reach the box, one pixel of slack for rounding
+		auto clamp = [](float v, uint32_t size) { return uint32_t(std::min(std::max(v, 0.0f), (float)size)); };
+		ScreenRect rect;
+		rect.x0 = clamp(std::floor(xMin) - 1, width);
+		rect.y0 = clamp(std::floor(yMin) - 1, height);
+		rect.x1 = clamp(std::ceil(xMax) + 1, width);
+		rect.y1 = clamp(std::ceil(yMax) + 1, height);
+		return rect;
+	}
+
+	// Trace and shade the given pixels in streams across the render threads
+	void Retrace(const Options &options, const PrimaryRays &rays, const std::vector<std::unique_ptr<Object>> &objects,
+		const std::vector<uint32_t> &pixels)
+	{
+		PROFILE_SCOPE("Retrace", (uint32_t)pixels.size());
+		std::unordered_map<const Object*, uint32_t> ids;
+		for (uint32_t k = 0; k < objects.size(); ++k)
+			ids[objects[k].get()] = k;
+		ThreadPool &pool = GetThreadPool(options.numThreads);
+		std::vector<std::vector<ScreenRect>> threadRects(pool.NumThreads(), std::vector<ScreenRect>(objects.size()));
+		uint32_t numStreams = uint32_t((pixels.size() + kRayStreamSize - 1) / kRayStreamSize);
+		pool.ParallelFor(numStreams, [&](uint32_t task, uint32_t thread) {
+			PROFILE_SCOPE("Tile", task);
+			size_t first = size_t(task) * kRayStreamSize;
+			uint32_t count = uint32_t(std::min(size_t(kRayStreamSize), pixels.size() - first));
+			RayStream stream;
+			stream.count = count;
+			Vec3f dirs[kRayStreamSize];
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t p = pixels[first + i];
+				// runs of a row share one call
+				uint32_t run = 1;
+				while (i + run < count && pixels[first + i + run] == p + run && (p + run) % width != 0)
+					run++;
+				rays.Generate(p / width, p % width, run, dirs + i);
+				for (uint32_t r = 0; r < run; ++r)
+					stream.Set(i + r, rays.orig, dirs[i + r]);
+				i += run - 1;
+			}
+			RayHits hits;
+			Object *hitObject[kRayStreamSize];
+			Trace(stream, objects, hits, hitObject);
+			std::vector<ScreenRect> &rects = threadRects[thread];
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t p = pixels[first + i];
+				if (hitObject[i] == nullptr)
+				{
+					colors[p] = options.backgroundColor;
+					objectIds[p] = kNoObject;
+					continue;
+				}
+				uint32_t id = ids.find(hitObject[i])->second;
+				colors[p] = Shade(hitObject[i], rays.orig, dirs[i], stream.tMax[i], hits.triIndex[i],
+					Vec2f(hits.u[i], hits.v[i]), rays.SpreadAngle());
+				objectIds[p] = id;
+				rects[id].Add(p % width, p / width);
+			}
+		});
+		for (const std::vector<ScreenRect> &rects : threadRects)
+			for (uint32_t k = 0; k < objects.size(); ++k)
+				objectRects[k].Add(rects[k]);
+	}
+
+	bool Write(const Options &options, uint32_t frame) const
+	{
+		PROFILE_SCOPE("WriteFrame", frame);
+		std::string outputFile = FrameFileName(options.outputName, frame);
+		PpmWriter writer;
+		if (!writer.Open(outputFile, width, height))
+		{
+			fprintf(stderr, "Cannot open %s for writing\n", outputFile.c_str());
+			return false;
+		}
+		writer.WriteRows(height, [&](uint32_t i, uint32_t j) { return colors[size_t(j) * width + i]; });
+		if (!writer.Close())
+		{
+			fprintf(stderr, "Failed writing %s\n", outputFile.c_str());
+			return false;
+		}
+		return true;
+	}
+
+public:
+	// Colors, object ids, dirty flags and the dirty list of a frame of this size, and its camera rays
+	static uint64_t Bytes(uint32_t w, uint32_t h)
+	{
+		return uint64_t(w) * h * (sizeof(Vec3f) + 2 * sizeof(uint32_t) + sizeof(uint8_t)) + uint64_t(w) * sizeof(float);
+	}
+
+	IncrementalStats lastUpdate;
+
+	const std::vector<Vec3f>& Colors() const { return colors; }
+
+	void Reset()
+	{
+		width = height = 0;
+		colors.clear();
+		objectIds.clear();
+		objectRects.clear();
+	}
+
+	// Render every pixel and write the frame out
+	void Render(const Options &options, const std::vector<std::unique_ptr<Object>> &objects, uint32_t frame)
+	{
+		Reset();
+		Update(options, objects, std::vector<uint32_t>(), frame);
+	}
+
+	// Bring the frame up to date after objects[k] for every k in changed was moved, had
+	// its geometry edited or was added at the end, then write it out. Every other
+	// object must keep its index. A different camera, or removed objects, render the
+	// whole frame again.
+	void Update(const Options &options, const std::vector<std::unique_ptr<Object>> &objects,
+		const std::vector<uint32_t> &changed, uint32_t frame)
+	{
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		PROFILE_SCOPE("RenderIncremental", frame);
+		PrimaryRays rays(options);
+		uint64_t activeTris = 0, fullDetailTris = 0;
+		SelectLevelsOfDetail(options, rays, objects, activeTris, fullDetailTris);
+
+		lastUpdate = IncrementalStats();
+		std::vector<uint32_t> pixels;
+		if (colors.empty() || !Matches(options, objects))
+		{
+			width = options.width;
+			height = options.height;
+			fov = options.fov;
+			cameraToWorld = options.cameraToWorld;
+			backgroundColor = options.backgroundColor;
+			colors.assign(size_t(width) * height, options.backgroundColor);
+			objectIds.assign(colors.size(), kNoObject);
+			dirty.assign(colors.size(), 0);
+			objectRects.assign(objects.size(), ScreenRect());
+			pixels.resize(colors.size());
+			for (uint32_t p = 0; p < pixels.size(); ++p)
+				pixels[p] = p;
+		}
+		else
+		{
+			PROFILE_SCOPE("DirtyPixels");
+			auto mark = [&](uint32_t p) {
+				if (dirty[p]) return;
+				dirty[p] = 1;
+				pixels.push_back(p);
+			};
+			std::vector<uint32_t> edited = changed;
+			for (uint32_t k = (uint32_t)objectRects.size(); k < objects.size(); ++k)
+				edited.push_back(k);
+			objectRects.resize(objects.size());
+			for (uint32_t k : edited)
+			{
+				if (k >= objects.size()) continue;
+				// pixels that saw the object, whatever is behind it shows through now
+				const ScreenRect old = objectRects[k];
+				for (uint32_t j = old.y0; j < old.y1; ++j)
+					for (uint32_t i = old.x0; i < old.x1; ++i)
+					{
+						uint32_t p = j * width + i;
+						if (objectIds[p] == k)
+						{
+							lastUpdate.previouslyCovered++;
+							mark(p);
+						}
+					}
+				// pixels the object can cover now
+				ScreenRect rect = ProjectBounds(options, rays, *objects[k]);
+				lastUpdate.projected += rect.Area();
+				for (uint32_t j = rect.y0; j < rect.y1; ++j)
+					for (uint32_t i = rect.x0; i < rect.x1; ++i)
+						mark(j * width + i);
+				// rebuilt from the retraced pixels, which hold all of the object now
+				objectRects[k] = ScreenRect();
+			}
+			// retraced in frame order, so that streams hold neighbouring rays
+			std::sort(pixels.begin(), pixels.end());
+			for (uint32_t p : pixels)
+				dirty[p] = 0;
+		}
+		Retrace(options, rays, objects, pixels);
+
+		lastUpdate.pixels = colors.size();
+		lastUpdate.retraced = pixels.size();
+		Write(options, frame);
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		lastUpdate.ms = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+		fprintf(stderr, "Frame %u: %.2f ms, retraced %llu of %llu pixels (%.1f%%: %llu covered by the changed objects, "
+			"%llu inside their new bounds)\n",
+			frame, lastUpdate.ms, (unsigned long long)lastUpdate.retraced, (unsigned long long)lastUpdate.pixels,
+			100 * lastUpdate.RetracedFraction(), (unsigned long long)lastUpdate.previouslyCovered,
+			(unsigned long long)lastUpdate.projected);
+	}
+};
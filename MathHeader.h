@@ -3,6 +3,7 @@
 #include "Vec2.h"
 #include "Vec3.h"
 #include "Matrix4x4.h"
+#include "VecSIMD.h"
 
 static const double PI = 3.14159265358979323846;
 static const double PI_2 = 1.57079632679489661923;
@@ -21,14 +22,13 @@ inline float deg2rad(const float &deg)
 }
 
 
-// Moller-Trumbore Algorithm
-bool rayTriangleIntersect(const Vec3f &origin, const Vec3f &direction,
-	const Vec3f &point0, const Vec3f &point1, const Vec3f &point2,
+// Moller-Trumbore Algorithm, with the triangle edges from point0 computed by the caller
+// so they can be shared by many rays
+inline bool rayTriangleIntersectEdges(const Vec3f &origin, const Vec3f &direction,
+	const Vec3f &point0, const Vec3f &edge0_1, const Vec3f &edge1_2,
 	float &t,
 	float &u, float &v)
 {
-	Vec3f edge0_1 = point1 - point0;
-	Vec3f edge1_2 = point2 - point0;
 	Vec3f perpVec = direction.CrossProduct(edge1_2);
 	float det = edge0_1.DotProduct(perpVec);
 
@@ -47,5 +47,14 @@ bool rayTriangleIntersect(const Vec3f &origin, const Vec3f &direction,
 
 	t = edge1_2.DotProduct(qVec) * invDet;
 
-	return true;
+	// hits behind the origin do not count
+	return t > 0;
+}
+
+bool rayTriangleIntersect(const Vec3f &origin, const Vec3f &direction,
+	const Vec3f &point0, const Vec3f &point1, const Vec3f &point2,
+	float &t,
+	float &u, float &v)
+{
+	return rayTriangleIntersectEdges(origin, direction, point0, point1 - point0, point2 - point0, t, u, v);
 }
\ No newline at end of file
@@ -188,6 +188,22 @@ public:
 		dst.z = c;
 	}
 
+	// Transform an array of points, src and dst may alias
+	template<typename S>
+	void MultPointVecs(const Vec3<S> *src, Vec3<S> *dst, size_t count) const
+	{
+		for (size_t i = 0; i < count; ++i)
+			MultPointVec(src[i], dst[i]);
+	}
+
+	// Transform an array of directions, src and dst may alias
+	template<typename S>
+	void MultDirVecs(const Vec3<S> *src, Vec3<S> *dst, size_t count) const
+	{
+		for (size_t i = 0; i < count; ++i)
+			MultDirVec(src[i], dst[i]);
+	}
+
 	template<typename S>
 	Matrix4x4<S> Translate(Matrix4x4<S> &matrix, Vec3<S> &vec)
 	{
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+// Bytes held by an object or a part of the renderer, by what they are used for
+struct MemoryUsage
+{
+	uint64_t positions = 0;
+	uint64_t indices = 0;
+	uint64_t normals = 0;     // per triangle corner
+	uint64_t texCoords = 0;   // per triangle corner
+	uint64_t bvh = 0;         // nodes and leaf triangle lists
+	uint64_t pageCache = 0;   // out-of-core page slots and the resident top of its BVH
+	uint64_t objects = 0;     // the object structures themselves, instance transforms
+	uint64_t framebuffer = 0; // band buffer, camera rays and per pixel history
+	uint64_t textures = 0;    // texture tile cache
+
+	MemoryUsage& operator += (const MemoryUsage &u)
+	{
+		positions += u.positions;
+		indices += u.indices;
+		normals += u.normals;
+		texCoords += u.texCoords;
+		bvh += u.bvh;
+		pageCache += u.pageCache;
+		objects += u.objects;
+		framebuffer += u.framebuffer;
+		textures += u.textures;
+		return *this;
+	}
+
+	uint64_t Geometry() const { return positions + indices + normals + texCoords; }
+	uint64_t Total() const { return Geometry() + bvh + pageCache + objects + framebuffer + textures; }
+};
+
+inline double Megabytes(uint64_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+inline void PrintMemoryUsage(const char *label, const MemoryUsage &u)
+{
+	fprintf(stderr, "%s: %.2f MB (geometry %.2f MB: positions %.2f, indices %.2f, normals %.2f, texcoords %.2f; "
+		"BVH %.2f MB, page cache %.2f MB, objects %.2f MB, framebuffer %.2f MB, textures %.2f MB)\n",
+		label, Megabytes(u.Total()), Megabytes(u.Geometry()), Megabytes(u.positions), Megabytes(u.indices),
+		Megabytes(u.normals), Megabytes(u.texCoords), Megabytes(u.bvh), Megabytes(u.pageCache),
+		Megabytes(u.objects), Megabytes(u.framebuffer), Megabytes(u.textures));
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+#include "TriangleMesh.h"
+
+// A shared triangle mesh placed in the world with its own transform. The mesh is
+// stored in its own object space; rays are moved into that space instead of
+// baking a copy of the geometry per placement. The level of detail is picked per
+// instance, so the same mesh can be near in one place and far in another.
+class MeshInstance : public Object
+{
+	std::shared_ptr<TriangleMesh> mesh;
+	Matrix4x4f worldToObject;
+	// inverse transpose of objectToWorld, for normals
+	Matrix4x4f normalToWorld;
+	bool identity;
+	uint32_t activeLevel = 0;
+
+	void ToObject(const Vec3f &orig, const Vec3f &dir, Vec3f &objOrig, Vec3f &objDir) const
+	{
+		worldToObject.MultPointVec(orig, objOrig);
+		// not normalized, so the hit distance t is the same in both spaces
+		worldToObject.MultDirVec(dir, objDir);
+	}
+
+public:
+	MeshInstance(const std::shared_ptr<TriangleMesh> &m, const Matrix4x4f &o2w) : mesh(m)
+	{
+		SetObjectToWorld(o2w);
+	}
+
+	// Move the instance, the shared mesh is left as is
+	void SetObjectToWorld(const Matrix4x4f &o2w)
+	{
+		objectToWorld = o2w;
+		worldToObject = o2w.Inverse();
+		const Matrix4x4f inverse = worldToObject;
+		normalToWorld = inverse.Transpose();
+		const Matrix4x4f id;
+		identity = true;
+		for (uint8_t i = 0; i < 4; ++i)
+			for (uint8_t j = 0; j < 4; ++j)
+				identity = identity && o2w[i][j] == id[i][j];
+	}
+
+	const TriangleMesh& Mesh() const { return *mesh; }
+	const std::shared_ptr<TriangleMesh>& SharedMesh() const { return mesh; }
+
+	bool Intersect(const Vec3f &orig, const Vec3f &dir, float tMin, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+	{
+		if (identity)
+			return mesh->IntersectLevel(activeLevel, orig, dir, tMin, tNear, triIndex, uv);
+		Vec3f objOrig, objDir;
+		ToObject(orig, dir, objOrig, objDir);
+		return mesh->IntersectLevel(activeLevel, objOrig, objDir, tMin, tNear, triIndex, uv);
+	}
+
+	void IntersectStream(RayStream &rays, RayHits &hits) const
+	{
+		if (identity)
+		{
+			mesh->IntersectStreamLevel(activeLevel, rays, hits);
+			return;
+		}
+		RayStream objRays;
+		objRays.count = rays.count;
+		for (uint32_t i = 0; i < rays.count; ++i)
+		{
+			Vec3f objOrig, objDir;
+			ToObject(rays.Origin(i), rays.Direction(i), objOrig, objDir);
+			objRays.Set(i, objOrig, objDir, rays.tMin[i], rays.tMax[i]);
+		}
+		mesh->IntersectStreamLevel(activeLevel, objRays, hits);
+		// distances are the same in both spaces
+		std::copy(objRays.tMax, objRays.tMax + rays.count, rays.tMax);
+	}
+
+	bool IntersectTriangle(const Vec3f &orig, const Vec3f &dir, uint32_t triIndex, float &t, Vec2f &uv) const
+	{
+		if (identity)
+			return mesh->IntersectTriangleLevel(activeLevel, orig, dir, triIndex, t, uv);
+		Vec3f objOrig, objDir;
+		ToObject(orig, dir, objOrig, objDir);
+		return mesh->IntersectTriangleLevel(activeLevel, objOrig, objDir, triIndex, t, uv);
+	}
+
+	uint32_t ActiveLevel() const { return activeLevel; }
+
+	bool GetTriangleCorners(uint32_t triIndex, Vec3f p[3], Vec2f st[3]) const
+	{
+		mesh->GetTriangleCornersLevel(activeLevel, triIndex, p, st);
+		if (identity) return true;
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			Vec3f objP = p[k];
+			objectToWorld.MultPointVec(objP, p[k]);
+		}
+		return true;
+	}
+
+	bool GetWorldBounds(Vec3f &lo, Vec3f &hi) const
+	{
+		Vec3f objLo, objHi;
+		if (!mesh->GetWorldBounds(objLo, objHi)) return false;
+		if (identity)
+		{
+			lo = objLo;
+			hi = objHi;
+			return true;
+		}
+		lo = Vec3f(kInfinity);
+		hi = Vec3f(-kInfinity);
+		for (uint32_t k = 0; k < 8; ++k)
+		{
+			Vec3f corner(k & 1 ? objHi.x : objLo.x, k & 2 ? objHi.y : objLo.y, k & 4 ? objHi.z : objLo.z), p;
+			objectToWorld.MultPointVec(corner, p);
+			lo = Vec3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+			hi = Vec3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+		}
+		return true;
+	}
+
+	void GetSurfaceProperties(
+		const Vec3f &hitPoint,
+		const Vec3f &viewDirection,
+		const uint32_t &triIndex,
+		const Vec2f &uv,
+		Vec3f &hitNormal,
+		Vec2f &hitTextureCoordinates) const
+	{
+		mesh->GetSurfacePropertiesLevel(activeLevel, triIndex, uv, hitNormal, hitTextureCoordinates);
+		if (identity) return;
+		Vec3f objNormal = hitNormal;
+		normalToWorld.MultDirVec(objNormal, hitNormal);
+		hitNormal.Normalize();
+	}
+
+	// Projected error is the same measured in object space, as long as the scale is uniform
+	void SelectLevelOfDetail(const Vec3f &eye, float pixelsPerUnit, float errorThreshold)
+	{
+		Vec3f objEye;
+		worldToObject.MultPointVec(eye, objEye);
+		activeLevel = mesh->PickLevel(objEye, pixelsPerUnit, errorThreshold);
+	}
+
+	void GetTriangleCounts(uint64_t &active, uint64_t &fullDetail) const
+	{
+		active += mesh->Levels()[activeLevel].numTris;
+		fullDetail += mesh->Levels()[0].numTris;
+	}
+
+	// The shared mesh is accounted for once per scene, not per instance
+	void GetMemoryUsage(MemoryUsage &usage) const { usage.objects += sizeof(MeshInstance); }
+};
+
+// The triangle mesh behind an object, directly or through an instance
+inline TriangleMesh* GetTriangleMesh(Object *object)
+{
+	if (MeshInstance *instance = dynamic_cast<MeshInstance*>(object))
+		return instance->SharedMesh().get();
+	return dynamic_cast<TriangleMesh*>(object);
+}
+
+// Memory held by the objects of a scene, optionally per object. A mesh shared by
+// several instances is counted with the first of them.
+inline MemoryUsage SceneMemoryUsage(const std::vector<std::unique_ptr<Object>> &objects, std::vector<MemoryUsage> *perObject = nullptr)
+{
+	MemoryUsage total;
+	std::unordered_set<const TriangleMesh*> counted;
+	if (perObject) perObject->assign(objects.size(), MemoryUsage());
+	for (size_t k = 0; k < objects.size(); ++k)
+	{
+		MemoryUsage usage;
+		objects[k]->GetMemoryUsage(usage);
+		const TriangleMesh *mesh = GetTriangleMesh(objects[k].get());
+		if (mesh != nullptr && mesh != objects[k].get() && counted.insert(mesh).second)
+			mesh->GetMemoryUsage(usage);
+		if (perObject) (*perObject)[k] = usage;
+		total += usage;
+	}
+	return total;
+}
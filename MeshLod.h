@@ -0,0 +1,376 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include "BVH.h"
+#include "MathHeader.h"
+
+// Stop building coarser levels once a level has fewer triangles than this
+static const uint32_t kLodMinTriangles = 16;
+
+// Weight of the constraint planes that keep open borders in place
+static const double kBorderWeight = 10;
+
+// Bounding box and sphere (centered on the box center) of a mesh
+struct MeshBounds
+{
+	Vec3f lo, hi;
+	Vec3f center;
+	float radius = 0;
+};
+
+// One level of detail of a triangle mesh. Positions are in world space,
+// normals and texture coordinates are stored per triangle corner.
+struct MeshLevel
+{
+	uint32_t numTris = 0;
+	uint32_t numVerts = 0;
+	std::unique_ptr<Vec3f[]> positions;
+	std::unique_ptr<uint32_t[]> indices;
+	std::unique_ptr<Vec3f[]> normals;
+	std::unique_ptr<Vec2f[]> texCoords;
+	// Largest geometric error (world units) introduced relative to full detail
+	float error = 0;
+	BVH bvh;
+
+	void BuildBVH(const BVHBuildOptions &options = BVHBuildOptions())
+	{
+		bvh.Build(positions.get(), indices.get(), numTris, options);
+	}
+
+	void GetMemoryUsage(MemoryUsage &usage) const
+	{
+		if (positions) usage.positions += uint64_t(numVerts) * sizeof(Vec3f);
+		if (indices) usage.indices += uint64_t(numTris) * 3 * sizeof(uint32_t);
+		if (normals) usage.normals += uint64_t(numTris) * 3 * sizeof(Vec3f);
+		if (texCoords) usage.texCoords += uint64_t(numTris) * 3 * sizeof(Vec2f);
+		usage.bvh += bvh.Bytes();
+	}
+};
+
+// Symmetric 4x4 error quadric, stored as its 10 unique coefficients
+struct Quadric
+{
+	double a[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	Quadric() {}
+	// Quadric of the plane n.p + d = 0, n normalized
+	Quadric(double nx, double ny, double nz, double d, double weight)
+	{
+		a[0] = nx * nx * weight; a[1] = nx * ny * weight; a[2] = nx * nz * weight; a[3] = nx * d * weight;
+		a[4] = ny * ny * weight; a[5] = ny * nz * weight; a[6] = ny * d * weight;
+		a[7] = nz * nz * weight; a[8] = nz * d * weight;
+		a[9] = d * d * weight;
+	}
+
+	Quadric& operator += (const Quadric &q)
+	{
+		for (int i = 0; i < 10; ++i) a[i] += q.a[i];
+		return *this;
+	}
+
+	// Sum of squared distances of p to the accumulated planes
+	double Evaluate(const Vec3f &p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+			+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+			+ a[7] * z * z + 2 * a[8] * z
+			+ a[9];
+	}
+};
+
+// Garland-Heckbert quadric error edge collapse over an indexed triangle mesh.
+// A single collapse pass is run and the mesh is snapshot every time its triangle
+// count halves, so each level is a simplification of the previous one.
+class MeshSimplifier
+{
+	struct Collapse
+	{
+		double cost;
+		uint32_t v0, v1;
+		uint32_t stamp0, stamp1;
+		Vec3f target;
+		bool operator < (const Collapse &c) const { return cost > c.cost; } // min-heap
+	};
+
+	const MeshLevel &source;
+	std::vector<Vec3f> positions;
+	std::vector<Quadric> quadrics;     // face planes plus weighted border planes, ranks collapses
+	std::vector<Quadric> faceQuadrics; // face planes only, at unit weight, measures the error
+	std::vector<bool> borderVertex;
+	std::vector<uint32_t> stamps;
+	std::vector<bool> vertexAlive;
+	std::vector<std::vector<uint32_t>> vertexFaces;
+	std::vector<uint32_t> faces; // 3 vertex indices per triangle, corners keep the source corner order
+	std::vector<bool> faceAlive;
+	std::priority_queue<Collapse> heap;
+	uint32_t liveTris;
+	double maxError = 0; // largest squared distance of a collapse target to the face planes it absorbed
+
+	Vec3f FaceNormal(uint32_t f, uint32_t moved, const Vec3f &movedPos) const
+	{
+		const uint32_t *v = &faces[f * 3];
+		Vec3f p0 = v[0] == moved ? movedPos : positions[v[0]];
+		Vec3f p1 = v[1] == moved ? movedPos : positions[v[1]];
+		Vec3f p2 = v[2] == moved ? movedPos : positions[v[2]];
+		return (p1 - p0).CrossProduct(p2 - p0);
+	}
+
+	// Reject collapses that would flip a surviving triangle around v
+	bool FlipsFaces(uint32_t v, uint32_t other, const Vec3f &target) const
+	{
+		for (uint32_t f : vertexFaces[v])
+		{
+			if (!faceAlive[f]) continue;
+			const uint32_t *fv = &faces[f * 3];
+			if (fv[0] == other || fv[1] == other || fv[2] == other) continue; // removed by the collapse
+			Vec3f before = FaceNormal(f, v, positions[v]);
+			Vec3f after = FaceNormal(f, v, target);
+			if (before.DotProduct(after) <= 0) return true;
+		}
+		return false;
+	}
+
+	// Live vertices sharing a triangle with v
+	void Neighbours(uint32_t v, std::vector<uint32_t> &out) const
+	{
+		out.clear();
+		for (uint32_t f : vertexFaces[v])
+		{
+			if (!faceAlive[f]) continue;
+			for (uint32_t k = 0; k < 3; ++k)
+				if (faces[f * 3 + k] != v) out.push_back(faces[f * 3 + k]);
+		}
+		std::sort(out.begin(), out.end());
+		out.erase(std::unique(out.begin(), out.end()), out.end());
+	}
+
+	// Link condition: the only vertices adjacent to both ends of the edge are the apexes of
+	// the one or two triangles on it, otherwise the collapse pinches the surface into a
+	// non-manifold fan. An inner edge between two border vertices would join two borders.
+	bool KeepsManifold(uint32_t v0, uint32_t v1) const
+	{
+		uint32_t edgeFaces = 0;
+		for (uint32_t f : vertexFaces[v0])
+		{
+			if (!faceAlive[f]) continue;
+			const uint32_t *fv = &faces[f * 3];
+			edgeFaces += fv[0] == v1 || fv[1] == v1 || fv[2] == v1;
+		}
+		if (edgeFaces == 0 || edgeFaces > 2) return false;
+		if (edgeFaces == 2 && borderVertex[v0] && borderVertex[v1]) return false;
+		std::vector<uint32_t> n0, n1;
+		Neighbours(v0, n0);
+		Neighbours(v1, n1);
+		uint32_t common = 0;
+		for (size_t i = 0, j = 0; i < n0.size() && j < n1.size();)
+		{
+			if (n0[i] < n1[j]) ++i;
+			else if (n1[j] < n0[i]) ++j;
+			else { ++common; ++i; ++j; }
+		}
+		return common == edgeFaces;
+	}
+
+	void PushEdge(uint32_t v0, uint32_t v1)
+	{
+		Quadric q = quadrics[v0];
+		q += quadrics[v1];
+		// cheapest of the two endpoints and the midpoint
+		Vec3f candidates[3] = { positions[v0], positions[v1], (positions[v0] + positions[v1]) * 0.5f };
+		Collapse c;
+		c.cost = kInfinity;
+		for (const Vec3f &p : candidates)
+		{
+			double cost = std::max(0.0, q.Evaluate(p));
+			if (cost < c.cost)
+			{
+				c.cost = cost;
+				c.target = p;
+			}
+		}
+		c.v0 = v0, c.v1 = v1;
+		c.stamp0 = stamps[v0], c.stamp1 = stamps[v1];
+		heap.push(c);
+	}
+
+	void PushVertexEdges(uint32_t v)
+	{
+		for (uint32_t f : vertexFaces[v])
+		{
+			if (!faceAlive[f]) continue;
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				uint32_t other = faces[f * 3 + k];
+				if (other != v && v < other) PushEdge(v, other);
+				else if (other != v) PushEdge(other, v);
+			}
+		}
+	}
+
+	// Collapse v1 into v0, returns false if the collapse is no longer valid
+	bool ApplyCollapse(const Collapse &c)
+	{
+		if (!vertexAlive[c.v0] || !vertexAlive[c.v1]) return false;
+		if (stamps[c.v0] != c.stamp0 || stamps[c.v1] != c.stamp1) return false;
+		if (!KeepsManifold(c.v0, c.v1)) return false;
+		if (FlipsFaces(c.v0, c.v1, c.target) || FlipsFaces(c.v1, c.v0, c.target)) return false;
+
+		Quadric faceQuadric = faceQuadrics[c.v0];
+		faceQuadric += faceQuadrics[c.v1];
+		maxError = std::max(maxError, faceQuadric.Evaluate(c.target));
+		positions[c.v0] = c.target;
+		quadrics[c.v0] += quadrics[c.v1];
+		faceQuadrics[c.v0] = faceQuadric;
+		borderVertex[c.v0] = borderVertex[c.v0] || borderVertex[c.v1];
+		vertexAlive[c.v1] = false;
+		for (uint32_t f : vertexFaces[c.v1])
+		{
+			if (!faceAlive[f]) continue;
+			uint32_t *fv = &faces[f * 3];
+			bool shared = fv[0] == c.v0 || fv[1] == c.v0 || fv[2] == c.v0;
+			if (shared)
+			{
+				faceAlive[f] = false;
+				liveTris--;
+				continue;
+			}
+			for (uint32_t k = 0; k < 3; ++k)
+				if (fv[k] == c.v1) fv[k] = c.v0;
+			vertexFaces[c.v0].push_back(f);
+		}
+		vertexFaces[c.v1].clear();
+		stamps[c.v0]++;
+		PushVertexEdges(c.v0);
+		return true;
+	}
+
+	// Compact the live part of the working mesh into a new level
+	MeshLevel Extract() const
+	{
+		MeshLevel level;
+		std::vector<uint32_t> remap(positions.size(), UINT32_MAX);
+		for (uint32_t f = 0; f < faceAlive.size(); ++f)
+		{
+			if (!faceAlive[f]) continue;
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				uint32_t v = faces[f * 3 + k];
+				if (remap[v] == UINT32_MAX) remap[v] = level.numVerts++;
+			}
+		}
+		level.numTris = liveTris;
+		level.positions = std::unique_ptr<Vec3f[]>(new Vec3f[level.numVerts]);
+		level.indices = std::unique_ptr<uint32_t[]>(new uint32_t[liveTris * 3]);
+		level.normals = std::unique_ptr<Vec3f[]>(new Vec3f[liveTris * 3]);
+		level.texCoords = std::unique_ptr<Vec2f[]>(new Vec2f[liveTris * 3]);
+		for (uint32_t v = 0; v < positions.size(); ++v)
+			if (remap[v] != UINT32_MAX) level.positions[remap[v]] = positions[v];
+		uint32_t l = 0;
+		for (uint32_t f = 0; f < faceAlive.size(); ++f)
+		{
+			if (!faceAlive[f]) continue;
+			// surviving corners keep the attributes of the source corner they replaced
+			for (uint32_t k = 0; k < 3; ++k, ++l)
+			{
+				level.indices[l] = remap[faces[f * 3 + k]];
+				level.normals[l] = source.normals[f * 3 + k];
+				level.texCoords[l] = source.texCoords[f * 3 + k];
+			}
+		}
+		// the face quadrics have unit weight, so this bounds the distance of every collapsed
+		// vertex to the original face planes merged into it. That is an estimate of the
+		// surface deviation, not a strict bound on it.
+		level.error = (float)std::sqrt(std::max(0.0, maxError));
+		return level;
+	}
+
+public:
+	MeshSimplifier(const MeshLevel &src) :
+		source(src),
+		positions(src.positions.get(), src.positions.get() + src.numVerts),
+		quadrics(src.numVerts),
+		faceQuadrics(src.numVerts),
+		borderVertex(src.numVerts, false),
+		stamps(src.numVerts, 0),
+		vertexAlive(src.numVerts, true),
+		vertexFaces(src.numVerts),
+		faces(src.indices.get(), src.indices.get() + src.numTris * 3),
+		faceAlive(src.numTris, true),
+		liveTris(src.numTris)
+	{
+		// accumulate face planes, and count edge use to find borders
+		std::vector<std::pair<uint64_t, uint32_t>> edges;
+		for (uint32_t f = 0; f < src.numTris; ++f)
+		{
+			const uint32_t *v = &faces[f * 3];
+			Vec3f n = (positions[v[1]] - positions[v[0]]).CrossProduct(positions[v[2]] - positions[v[0]]);
+			double area = n.Length();
+			if (area > 0) n *= float(1 / area);
+			Quadric q(n.x, n.y, n.z, -n.DotProduct(positions[v[0]]), 1);
+			for (uint32_t k = 0; k < 3; ++k)
+			{
+				quadrics[v[k]] += q;
+				faceQuadrics[v[k]] += q;
+				vertexFaces[v[k]].push_back(f);
+				uint32_t a = v[k], b = v[(k + 1) % 3];
+				edges.push_back(std::make_pair(uint64_t(std::min(a, b)) << 32 | std::max(a, b), f));
+			}
+		}
+		// border edges get a heavily weighted plane perpendicular to their face
+		// so that open boundaries do not shrink
+		std::sort(edges.begin(), edges.end());
+		for (size_t i = 0; i < edges.size(); ++i)
+		{
+			bool border = (i == 0 || edges[i - 1].first != edges[i].first) &&
+				(i + 1 == edges.size() || edges[i + 1].first != edges[i].first);
+			if (!border) continue;
+			uint32_t a = uint32_t(edges[i].first >> 32), b = uint32_t(edges[i].first & 0xffffffff);
+			const uint32_t *v = &faces[edges[i].second * 3];
+			Vec3f faceN = (positions[v[1]] - positions[v[0]]).CrossProduct(positions[v[2]] - positions[v[0]]);
+			Vec3f edge = positions[b] - positions[a];
+			Vec3f n = edge.CrossProduct(faceN);
+			n.Normalize();
+			Quadric q(n.x, n.y, n.z, -n.DotProduct(positions[a]), kBorderWeight);
+			quadrics[a] += q;
+			quadrics[b] += q;
+			borderVertex[a] = borderVertex[b] = true;
+		}
+		for (size_t i = 0; i < edges.size(); ++i)
+		{
+			if (i > 0 && edges[i - 1].first == edges[i].first) continue;
+			PushEdge(uint32_t(edges[i].first >> 32), uint32_t(edges[i].first & 0xffffffff));
+		}
+	}
+
+	// Collapse edges until at most targetTris remain or no valid collapse is left
+	bool Simplify(uint32_t targetTris)
+	{
+		uint32_t startTris = liveTris;
+		while (liveTris > targetTris && !heap.empty())
+		{
+			Collapse c = heap.top();
+			heap.pop();
+			ApplyCollapse(c);
+		}
+		return liveTris < startTris;
+	}
+
+	// Build levels 1..n, each with about half the triangles of the one before
+	static std::vector<MeshLevel> BuildChain(const MeshLevel &fullDetail)
+	{
+		std::vector<MeshLevel> chain;
+		MeshSimplifier simplifier(fullDetail);
+		uint32_t target = fullDetail.numTris / 2;
+		while (target >= kLodMinTriangles && simplifier.Simplify(target))
+		{
+			chain.push_back(simplifier.Extract());
+			target = chain.back().numTris / 2;
+		}
+		return chain;
+	}
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Raytracer.h"
+
+// One camera of a multi-view job
+struct ViewCamera
+{
+	Matrix4x4f cameraToWorld;
+	uint32_t width = 640;
+	uint32_t height = 480;
+	float fov = 90;
+};
+
+struct MultiViewStats
+{
+	uint32_t views = 0;
+	uint64_t pixels = 0;
+	uint32_t failedViews = 0;  // output could not be opened or written
+	uint32_t peakBands = 0;    // most bands resident at once, over every view
+	uint64_t peakBandBytes = 0;
+	double ms = 0;
+
+	double ViewsPerMinute() const { return ms > 0 ? views * 60000.0 / ms : 0; }
+};
+
+// Cameras orbiting the camera of options about the world y axis, evenly spaced over a full turn
+inline std::vector<ViewCamera> TurntableViews(const Options &options, uint32_t numViews)
+{
+	std::vector<ViewCamera> views(numViews);
+	for (uint32_t v = 0; v < numViews; ++v)
+	{
+		float angle = deg2rad(360.0f * v / numViews);
+		Matrix4x4f orbit;
+		orbit[0][0] = cos(angle); orbit[0][2] = -sin(angle);
+		orbit[2][0] = sin(angle); orbit[2][2] = cos(angle);
+		views[v].cameraToWorld = options.cameraToWorld * orbit;
+		views[v].width = options.width;
+		views[v].height = options.height;
+		views[v].fov = options.fov;
+	}
+	return views;
+}
+
+// Renders many views of one scene as one job. The scene and its BVHs are shared, and the
+// tiles of every view go to the thread pool as a single ParallelFor, so there is no
+// barrier between bands or views. The thread that completes the last tile of a band
+// queues it and moves on; a separate writer thread writes the queued bands out, in row
+// order per view, so render threads never wait on file output. Views are scheduled in
+// order, which keeps only a few bands of the views at the front of the queue resident,
+// and a render thread that would start a band past kResidentBandsPerThread bands per
+// thread waits for the writer to catch up.
+//
+// Objects keep one level of detail for the whole job, the finest any view needs, so no
+// view sees more error than options.lodErrorThreshold allows.
+class MultiViewRenderer
+{
+	static const uint32_t kResidentBandsPerThread = 4;
+
+	struct Band
+	{
+		std::unique_ptr<BandBuffer> pixels;
+		std::atomic<uint32_t> tilesLeft;
+	};
+
+	struct View
+	{
+		Options options;
+		std::unique_ptr<PrimaryRays> rays;
+		uint32_t frame = 0;
+		uint32_t bandHeight = 0, numBands = 0, tilesPerRow = 0;
+		uint32_t firstTask = 0;
+		uint32_t firstBand = 0; // index of band 0 among the bands of the job
+		// guards bands
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Band>> bands;
+		// only touched by the writer thread
+		std::vector<uint8_t> finished;
+		uint32_t nextBand = 0;
+		PpmWriter writer;
+		bool failed = false;
+
+		uint32_t BandRows(uint32_t b) const { return std::min(bandHeight, options.height - b * bandHeight); }
+	};
+
+	std::vector<std::unique_ptr<View>> views;
+	// guards residentBands, started and startedEnd
+	std::mutex residentMutex;
+	std::condition_variable bandWritten;
+	uint32_t maxResidentBands = 0;
+	std::vector<uint8_t> started; // per band of the job, in task order
+	uint32_t startedEnd = 0;      // one past the last band started
+	std::atomic<uint32_t> residentBands;
+	std::atomic<uint32_t> peakBands;
+	std::atomic<uint64_t> residentBytes;
+	std::atomic<uint64_t> peakBytes;
+	// finished bands waiting for the writer thread
+	std::mutex queueMutex;
+	std::condition_variable queued;
+	std::deque<std::pair<View*, uint32_t>> finishedBands;
+	bool tracingDone = false;
+
+	template<typename T>
+	static void RaiseTo(std::atomic<T> &peak, T value)
+	{
+		T seen = peak.load();
+		while (seen < value && !peak.compare_exchange_weak(seen, value)) {}
+	}
+
+	// The finest level any view picks for each object
+	static void SelectLevelsOfDetail(const std::vector<std::unique_ptr<View>> &views,
+		const std::vector<std::unique_ptr<Object>> &objects)
+	{
+		PROFILE_SCOPE("SelectLod");
+		for (const auto &object : objects)
+		{
+			const View *finest = nullptr;
+			uint32_t finestLevel = UINT32_MAX;
+			for (const auto &view : views)
+			{
+				object->SelectLevelOfDetail(view->rays->orig, view->rays->PixelsPerUnit(), view->options.lodErrorThreshold);
+				if (object->ActiveLevel() < finestLevel)
+				{
+					finestLevel = object->ActiveLevel();
+					finest = view.get();
+				}
+			}
+			if (finest)
+				object->SelectLevelOfDetail(finest->rays->orig, finest->rays->PixelsPerUnit(), finest->options.lodErrorThreshold);
+		}
+	}
+
+	// Band b of view, started on first use. Starting a band past the last one started waits
+	// while maxResidentBands are resident. Tasks are claimed in order, so every started band
+	// has all its tasks claimed and finishes; a band behind one already started never waits,
+	// since a band after it in the same view may need it to be written. So the writer can
+	// always free a band, and at most one band per thread goes over the limit.
+	Band& AcquireBand(View &view, uint32_t b)
+	{
+		uint32_t g = view.firstBand + b;
+		{
+			std::unique_lock<std::mutex> lock(residentMutex);
+			bandWritten.wait(lock, [&]() { return started[g] || g < startedEnd || residentBands < maxResidentBands; });
+			if (!started[g])
+			{
+				started[g] = 1;
+				startedEnd = std::max(startedEnd, g + 1);
+				RaiseTo(peakBands, ++residentBands);
+			}
+		}
+		std::lock_guard<std::mutex> lock(view.mutex);
+		std::unique_ptr<Band> &band = view.bands[b];
+		if (!band)
+		{
+			band.reset(new Band);
+			band->pixels.reset(new BandBuffer(view.options.width, view.bandHeight, view.options.halfFloatBands));
+			band->tilesLeft = view.tilesPerRow * view.BandRows(b);
+			RaiseTo(peakBytes, residentBytes += band->pixels->Bytes());
+		}
+		return *band;
+	}
+
+	// Hand a band whose tiles are all done to the writer thread
+	void FinishBand(View &view, uint32_t b)
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		finishedBands.push_back(std::make_pair(&view, b));
+		queued.notify_one();
+	}
+
+	// Writer thread: write out the queued bands until tracing is done and the queue is empty
+	void WriteBands()
+	{
+		while (true)
+		{
+			std::pair<View*, uint32_t> next;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queued.wait(lock, [&]() { return tracingDone || !finishedBands.empty(); });
+				if (finishedBands.empty()) return;
+				next = finishedBands.front();
+				finishedBands.pop_front();
+			}
+			WriteBand(*next.first, next.second);
+		}
+	}
+
+	// Write out band b and every finished band after it that is next in row order
+	void WriteBand(View &view, uint32_t b)
+	{
+		view.finished[b] = 1;
+		while (view.nextBand < view.numBands && view.finished[view.nextBand])
+		{
+			PROFILE_SCOPE("WriteBand", view.nextBand);
+			if (view.nextBand == 0)
+			{
+				std::string outputFile = FrameFileName(view.options.outputName, view.frame);
+				if (!view.writer.Open(outputFile, view.options.width, view.options.height))
+				{
+					fprintf(stderr, "Cannot open %s for writing\n", outputFile.c_str());
+					view.failed = true;
+				}
+			}
+			Band *band;
+			{
+				std::lock_guard<std::mutex> bandLock(view.mutex);
+				band = view.bands[view.nextBand].get();
+			}
+			if (!view.failed)
+				view.writer.WriteRows(*band->pixels, view.BandRows(view.nextBand));
+			residentBytes -= band->pixels->Bytes();
+			{
+				std::lock_guard<std::mutex> bandLock(view.mutex);
+				view.bands[view.nextBand].reset();
+			}
+			{
+				std::lock_guard<std::mutex> lock(residentMutex);
+				residentBands--;
+				bandWritten.notify_all();
+			}
+			view.nextBand++;
+		}
+		if (view.nextBand == view.numBands && !view.failed && !view.writer.Close())
+		{
+			fprintf(stderr, "Failed writing %s\n", FrameFileName(view.options.outputName, view.frame).c_str());
+			view.failed = true;
+		}
+	}
+
+public:
+	MultiViewStats lastJob;
+
+	// Render every camera into FrameFileName(options.outputName, firstFrame + view index).
+	// Everything but the camera, resolution and field of view comes from options.
+	MultiViewStats Render(const Options &options, const std::vector<ViewCamera> &cameras,
+		const std::vector<std::unique_ptr<Object>> &objects, uint32_t firstFrame = 0)
+	{
+		PROFILE_SCOPE("RenderViews", (uint32_t)cameras.size());
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		residentBands = 0;
+		peakBands = 0;
+		residentBytes = 0;
+		peakBytes = 0;
+		views.clear();
+		lastJob = MultiViewStats();
+		uint32_t numTasks = 0, numBands = 0;
+		for (uint32_t v = 0; v < cameras.size(); ++v)
+		{
+			std::unique_ptr<View> view(new View);
+			view->options = options;
+			view->options.cameraToWorld = cameras[v].cameraToWorld;
+			view->options.width = cameras[v].width;
+			view->options.height = cameras[v].height;
+			view->options.fov = cameras[v].fov;
+			view->rays.reset(new PrimaryRays(view->options));
+			view->frame = firstFrame + v;
+			view->bandHeight = std::max(1u, std::min(options.bandHeight, cameras[v].height));
+			view->numBands = (cameras[v].height + view->bandHeight - 1) / view->bandHeight;
+			view->tilesPerRow = (cameras[v].width + kTileSize - 1) / kTileSize;
+			view->firstTask = numTasks;
+			view->firstBand = numBands;
+			numBands += view->numBands;
+			view->bands.resize(view->numBands);
+			view->finished.assign(view->numBands, 0);
+			numTasks += view->tilesPerRow * cameras[v].height;
+			lastJob.pixels += uint64_t(cameras[v].width) * cameras[v].height;
+			views.push_back(std::move(view));
+		}
+		SelectLevelsOfDetail(views, objects);
+
+		ThreadPool &pool = GetThreadPool(options.numThreads);
+		maxResidentBands = std::max(2u, kResidentBandsPerThread * pool.NumThreads());
+		started.assign(numBands, 0);
+		startedEnd = 0;
+		tracingDone = false;
+		std::thread writer(&MultiViewRenderer::WriteBands, this);
+		pool.ParallelFor(numTasks, [&](uint32_t task, uint32_t) {
+			PROFILE_SCOPE("Tile", task);
+			auto next = std::upper_bound(views.begin(), views.end(), task,
+				[](uint32_t t, const std::unique_ptr<View> &view) { return t < view->firstTask; });
+			View &view = **(next - 1);
+			uint32_t viewTask = task - view.firstTask;
+			uint32_t j = viewTask / view.tilesPerRow;
+			uint32_t x0 = (viewTask % view.tilesPerRow) * kTileSize;
+			uint32_t b = j / view.bandHeight;
+			Band &band = AcquireBand(view, b);
+			RenderTile(view.options, *view.rays, objects, j, x0, std::min(kTileSize, view.options.width - x0),
+				*band.pixels, j - b * view.bandHeight);
+			if (--band.tilesLeft == 0)
+				FinishBand(view, b);
+		});
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			tracingDone = true;
+			queued.notify_one();
+		}
+		writer.join();
+
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		lastJob.ms = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+		lastJob.views = (uint32_t)views.size();
+		for (const auto &view : views)
+			lastJob.failedViews += view->failed;
+		lastJob.peakBands = peakBands;
+		lastJob.peakBandBytes = peakBytes;
+		views.clear();
+		return lastJob;
+	}
+};
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <memory>
+
 #include "geometry.h"
+#include "MemoryUsage.h"
+#include "RayStream.h"
+
+class Texture;
 
 // Base class for scene geometry
 class Object
@@ -9,7 +15,45 @@ public:
 	Object() {}
 	Object(const Matrix4x4f &o2w) : objectToWorld(o2w) {}
 	virtual ~Object() {}
-	virtual bool Intersect(const Vec3f &, const Vec3f &, float &, uint32_t &, Vec2f &) const = 0;
+	// Closest hit with tMin < t < tNear, tNear comes in as the far limit and is set to the hit
+	virtual bool Intersect(const Vec3f &, const Vec3f &, float, float &, uint32_t &, Vec2f &) const = 0;
 	virtual void GetSurfaceProperties(const Vec3f &, const Vec3f &, const uint32_t &, const Vec2f &, Vec3f &, Vec2f &) const = 0;
+	// Pick the detail to render with from the eye position, the pixels covered by one world
+	// unit at unit distance and the allowed screen space error in pixels
+	virtual void SelectLevelOfDetail(const Vec3f &, float, float) {}
+	// Add the triangles in the selected and in the full detail representation
+	virtual void GetTriangleCounts(uint64_t &, uint64_t &) const {}
+	// Index of the selected level of detail, triangle indices are only comparable within a level
+	virtual uint32_t ActiveLevel() const { return 0; }
+	// Intersect a single triangle of the selected level of detail, used to check that a
+	// previous hit is still valid. Objects that cannot do this never report a hit.
+	virtual bool IntersectTriangle(const Vec3f &, const Vec3f &, uint32_t, float &, Vec2f &) const { return false; }
+	// Intersect a whole stream of rays, see RayStream and RayHits. This adapter calls
+	// Intersect per ray.
+	virtual void IntersectStream(RayStream &rays, RayHits &hits) const
+	{
+		for (uint32_t i = 0; i < rays.count; ++i)
+		{
+			float t = rays.tMax[i];
+			uint32_t triIndex;
+			Vec2f uv;
+			if (Intersect(rays.Origin(i), rays.Direction(i), rays.tMin[i], t, triIndex, uv))
+			{
+				rays.tMax[i] = t;
+				hits.Set(i, triIndex, uv.x, uv.y);
+			}
+		}
+	}
+	// Add the memory held by this object. Geometry shared between objects is not
+	// included, see SceneMemoryUsage.
+	virtual void GetMemoryUsage(MemoryUsage &usage) const { usage.objects += sizeof(Object); }
+	// World space corners and texture coordinates of a triangle of the selected level of
+	// detail, for texture filtering. Objects without triangles return false.
+	virtual bool GetTriangleCorners(uint32_t, Vec3f [3], Vec2f [3]) const { return false; }
+	// World space bounding box of the object. Objects that cannot bound themselves return
+	// false and are treated as covering the whole screen.
+	virtual bool GetWorldBounds(Vec3f &, Vec3f &) const { return false; }
 	Matrix4x4f objectToWorld;
+	// sampled by Shade in place of the checker pattern when set
+	std::shared_ptr<Texture> texture;
 };
@@ -0,0 +1,537 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BVH.h"
+#include "MeshLod.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only memory mapping of a whole file
+class MappedFile
+{
+	const char *data = nullptr;
+	uint64_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile& operator = (const MappedFile &) = delete;
+	~MappedFile() { Close(); }
+
+	bool Open(const char *path)
+	{
+		Close();
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr) { Close(); return false; }
+		data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd = open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		fstat(fd, &st);
+		size = st.st_size;
+		void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		data = p == MAP_FAILED ? nullptr : (const char*)p;
+#endif
+		if (data == nullptr) { Close(); return false; }
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap((void*)data, size);
+		if (fd >= 0) close(fd);
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const char* Data() const { return data; }
+	uint64_t Size() const { return size; }
+};
+
+struct PageCacheStats
+{
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t bytesFaulted = 0;
+	uint64_t evictions = 0;
+
+	double HitRate() const { return hits + misses ? hits / double(hits + misses) : 1.0; }
+};
+
+// Bounded set of resident pages of a mapped file with LRU eviction. Only pages
+// copied into the cache are touched, so the resident footprint of the scene data
+// stays at budget bytes no matter how large the file is. Thread safe: pages are
+// spread over shards, each with its own lock, LRU list and share of the budget, so
+// threads reading different pages rarely wait on each other.
+class PageCache
+{
+	static const uint32_t kMaxShards = 16;
+	static const uint32_t kMinSlotsPerShard = 16;
+
+	struct Page
+	{
+		uint32_t slot;
+		std::list<uint64_t>::iterator lru;
+	};
+
+	struct Shard
+	{
+		mutable std::mutex mutex;
+		uint32_t numSlots = 0;
+		std::unique_ptr<char[]> slots;
+		std::vector<uint32_t> freeSlots;
+		std::unordered_map<uint64_t, Page> pages;
+		std::list<uint64_t> lru; // most recently used first
+		PageCacheStats stats;
+	};
+
+	const MappedFile &file;
+	uint32_t pageSize;
+	uint32_t numShards;
+	Shard shards[kMaxShards];
+
+	// consecutive pages, which the blocks of a leaf span, land in different shards
+	uint32_t ShardOf(uint64_t page) const { return uint32_t(((page * 0x9E3779B97F4A7C15ull) >> 32) % numShards); }
+
+	// Make page resident and return its slot, nullptr for a page past the end of the
+	// file. Caller holds the shard lock.
+	const char* Fetch(Shard &shard, uint64_t page)
+	{
+		auto it = shard.pages.find(page);
+		if (it != shard.pages.end())
+		{
+			shard.stats.hits++;
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+			return &shard.slots[size_t(it->second.slot) * pageSize];
+		}
+		uint64_t offset = page * pageSize;
+		if (offset >= file.Size()) return nullptr;
+		shard.stats.misses++;
+		uint32_t slot;
+		if (shard.freeSlots.empty())
+		{
+			uint64_t victim = shard.lru.back();
+			shard.lru.pop_back();
+			slot = shard.pages[victim].slot;
+			shard.pages.erase(victim);
+			shard.stats.evictions++;
+		}
+		else
+		{
+			slot = shard.freeSlots.back();
+			shard.freeSlots.pop_back();
+		}
+		uint64_t bytes = std::min<uint64_t>(pageSize, file.Size() - offset);
+		char *dst = &shard.slots[size_t(slot) * pageSize];
+		memcpy(dst, file.Data() + offset, (size_t)bytes);
+		memset(dst + bytes, 0, size_t(pageSize - bytes));
+		shard.stats.bytesFaulted += bytes;
+		shard.lru.push_front(page);
+		shard.pages[page] = Page{ slot, shard.lru.begin() };
+		return dst;
+	}
+
+public:
+	PageCache(const MappedFile &f, uint64_t budgetBytes, uint32_t pageBytes = 4096) :
+		file(f), pageSize(pageBytes)
+	{
+		uint64_t numSlots = std::max<uint64_t>(1, budgetBytes / pageSize);
+		numShards = (uint32_t)std::min<uint64_t>(kMaxShards, std::max<uint64_t>(1, numSlots / kMinSlotsPerShard));
+		for (uint32_t s = 0; s < numShards; ++s)
+		{
+			Shard &shard = shards[s];
+			shard.numSlots = uint32_t(numSlots / numShards);
+			shard.slots = std::unique_ptr<char[]>(new char[size_t(shard.numSlots) * pageSize]);
+			for (uint32_t i = shard.numSlots; i > 0; --i)
+				shard.freeSlots.push_back(i - 1);
+		}
+	}
+
+	// Copy size bytes at offset into dst, faulting in the pages it spans. Bytes past the
+	// end of the file read as 0, and make it return false.
+	bool Read(uint64_t offset, size_t size, void *dst)
+	{
+		char *out = (char*)dst;
+		while (size > 0)
+		{
+			uint64_t page = offset / pageSize;
+			uint32_t inPage = uint32_t(offset % pageSize);
+			size_t bytes = std::min<size_t>(size, pageSize - inPage);
+			Shard &shard = shards[ShardOf(page)];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			const char *src = Fetch(shard, page);
+			if (src == nullptr)
+			{
+				memset(out, 0, size);
+				return false;
+			}
+			memcpy(out, src + inPage, bytes);
+			out += bytes, offset += bytes, size -= bytes;
+		}
+		return offset <= file.Size();
+	}
+
+	PageCacheStats Stats() const
+	{
+		PageCacheStats total;
+		for (uint32_t s = 0; s < numShards; ++s)
+		{
+			std::lock_guard<std::mutex> lock(shards[s].mutex);
+			total.hits += shards[s].stats.hits;
+			total.misses += shards[s].stats.misses;
+			total.bytesFaulted += shards[s].stats.bytesFaulted;
+			total.evictions += shards[s].stats.evictions;
+		}
+		return total;
+	}
+	uint64_t BudgetBytes() const { return uint64_t(shards[0].numSlots) * numShards * pageSize; }
+};
+
+// Triangles per leaf block of an out-of-core mesh
+static const uint32_t kOutOfCoreBlockTris = 32;
+
+// Every level of detail of a triangle mesh, kept in a mapped file instead of memory.
+// Only the BVH nodes of each level stay resident; the BVHs are built so that every
+// leaf is a single block of at most kOutOfCoreBlockTris triangles, a run of the file
+// read through one page cache shared by all levels. A file written by Write can be
+// opened again by a later run without the mesh ever being loaded into memory.
+//
+// File layout:
+//   OutOfCoreHeader
+//   OutOfCoreLevelInfo per level, finest first
+//   per level: BVH nodes, positions (3 Vec3f per triangle, in leaf order),
+//     attributes (one OutOfCoreAttributes per triangle, in leaf order)
+class OutOfCoreMesh
+{
+	struct OutOfCoreHeader
+	{
+		char magic[8];
+		uint32_t numLevels;
+		uint32_t reserved;
+		float boundsLo[3];
+		float boundsHi[3];
+		float boundsCenter[3];
+		float boundsRadius;
+	};
+
+	struct OutOfCoreAttributes
+	{
+		Vec3f normals[3];
+		Vec2f texCoords[3];
+		uint32_t sourceTriangle;
+	};
+
+public:
+	struct OutOfCoreLevelInfo
+	{
+		uint32_t numTris;
+		uint32_t numVerts;
+		float error;
+		uint32_t numNodes;
+		uint64_t nodesOffset;
+		uint64_t positionsOffset;
+		uint64_t attributesOffset;
+	};
+
+private:
+	struct Level
+	{
+		OutOfCoreLevelInfo info;
+		BVH bvh; // nodes only, leaf offsets index the file
+	};
+
+	std::string path;
+	bool removeOnClose = false;
+	MappedFile file;
+	std::unique_ptr<PageCache> cache;
+	std::vector<Level> levels;
+	MeshBounds bounds;
+
+	template<typename T>
+	static void WriteArray(std::ostream &os, const T *data, size_t count)
+	{
+		os.write((const char*)data, count * sizeof(T));
+	}
+
+public:
+	OutOfCoreMesh() {}
+	OutOfCoreMesh(const OutOfCoreMesh &) = delete;
+	OutOfCoreMesh& operator = (const OutOfCoreMesh &) = delete;
+	~OutOfCoreMesh()
+	{
+		file.Close();
+		if (removeOnClose) remove(path.c_str());
+	}
+
+	// Write levels to path, each in the leaf block order of its own block BVH
+	static bool Write(const std::vector<MeshLevel> &levels, const MeshBounds &bounds, const std::string &filePath, std::string &error)
+	{
+		PROFILE_SCOPE("WriteOutOfCore", levels.empty() ? 0 : levels[0].numTris);
+		BVHBuildOptions blockOptions;
+		blockOptions.leafSize = kOutOfCoreBlockTris;
+		blockOptions.blockLeaves = true;
+		std::vector<BVH> bvhs(levels.size());
+		std::vector<OutOfCoreLevelInfo> infos(levels.size());
+		uint64_t offset = sizeof(OutOfCoreHeader) + levels.size() * sizeof(OutOfCoreLevelInfo);
+		for (size_t l = 0; l < levels.size(); ++l)
+		{
+			const MeshLevel &level = levels[l];
+			if (!level.positions || !level.indices || !level.texCoords)
+			{
+				error = "level " + std::to_string(l) + " is not in memory";
+				return false;
+			}
+			bvhs[l].Build(level.positions.get(), level.indices.get(), level.numTris, blockOptions);
+			OutOfCoreLevelInfo &info = infos[l];
+			info.numTris = level.numTris;
+			info.numVerts = level.numVerts;
+			info.error = level.error;
+			info.numNodes = (uint32_t)bvhs[l].nodes.size();
+			info.nodesOffset = offset;
+			info.positionsOffset = info.nodesOffset + uint64_t(info.numNodes) * sizeof(BVHNode);
+			info.attributesOffset = info.positionsOffset + uint64_t(info.numTris) * 3 * sizeof(Vec3f);
+			offset = info.attributesOffset + uint64_t(info.numTris) * sizeof(OutOfCoreAttributes);
+		}
+
+		std::ofstream ofs(filePath, std::ios::binary);
+		if (ofs.fail())
+		{
+			error = "cannot open " + filePath + " for writing";
+			return false;
+		}
+		OutOfCoreHeader header = {};
+		memcpy(header.magic, "MRTOOC02", 8);
+		header.numLevels = (uint32_t)levels.size();
+		for (uint8_t a = 0; a < 3; ++a)
+		{
+			header.boundsLo[a] = bounds.lo[a];
+			header.boundsHi[a] = bounds.hi[a];
+			header.boundsCenter[a] = bounds.center[a];
+		}
+		header.boundsRadius = bounds.radius;
+		ofs.write((const char*)&header, sizeof(header));
+		WriteArray(ofs, infos.data(), infos.size());
+		for (size_t l = 0; l < levels.size(); ++l)
+		{
+			const MeshLevel &level = levels[l];
+			const BVH &bvh = bvhs[l];
+			WriteArray(ofs, bvh.nodes.data(), bvh.nodes.size());
+			for (uint32_t i = 0; i < level.numTris; ++i)
+			{
+				uint32_t tri = bvh.triIndices[i];
+				for (uint32_t k = 0; k < 3; ++k)
+					ofs.write((const char*)&level.positions[level.indices[tri * 3 + k]], sizeof(Vec3f));
+			}
+			for (uint32_t i = 0; i < level.numTris; ++i)
+			{
+				uint32_t tri = bvh.triIndices[i];
+				OutOfCoreAttributes attr;
+				for (uint32_t k = 0; k < 3; ++k)
+				{
+					// corner normals may have been dropped to save memory
+					attr.normals[k] = level.normals ? level.normals[tri * 3 + k] : Vec3f(0);
+					attr.texCoords[k] = level.texCoords[tri * 3 + k];
+				}
+				attr.sourceTriangle = tri;
+				ofs.write((const char*)&attr, sizeof(attr));
+			}
+		}
+		ofs.close();
+		if (ofs.fail())
+		{
+			error = "failed writing " + filePath;
+			return false;
+		}
+		return true;
+	}
+
+	// Map a file written by Write with a page cache of budgetBytes. Only the headers and
+	// the BVH nodes are read up front. With removeWhenClosed the file is scratch space
+	// and deleted with this object.
+	bool Open(const std::string &filePath, uint64_t budgetBytes, bool removeWhenClosed, std::string &error)
+	{
+		PROFILE_SCOPE("OpenOutOfCore");
+		levels.clear();
+		path = filePath;
+		removeOnClose = removeWhenClosed;
+		if (!file.Open(path.c_str()))
+		{
+			error = "cannot open " + path;
+			return false;
+		}
+		OutOfCoreHeader header;
+		if (file.Size() < sizeof(header))
+		{
+			error = path + " is not an out-of-core mesh";
+			return false;
+		}
+		memcpy(&header, file.Data(), sizeof(header));
+		uint64_t infoEnd = sizeof(header) + uint64_t(header.numLevels) * sizeof(OutOfCoreLevelInfo);
+		if (memcmp(header.magic, "MRTOOC02", 8) != 0 || header.numLevels == 0 || infoEnd > file.Size())
+		{
+			error = path + " is not an out-of-core mesh";
+			return false;
+		}
+		bounds.lo = Vec3f(header.boundsLo[0], header.boundsLo[1], header.boundsLo[2]);
+		bounds.hi = Vec3f(header.boundsHi[0], header.boundsHi[1], header.boundsHi[2]);
+		bounds.center = Vec3f(header.boundsCenter[0], header.boundsCenter[1], header.boundsCenter[2]);
+		bounds.radius = header.boundsRadius;
+		levels.resize(header.numLevels);
+		for (uint32_t l = 0; l < header.numLevels; ++l)
+		{
+			Level &level = levels[l];
+			OutOfCoreLevelInfo &info = level.info;
+			memcpy(&info, file.Data() + sizeof(header) + l * sizeof(OutOfCoreLevelInfo), sizeof(info));
+			// offsets in order and inside the file first, so the sums below cannot wrap
+			if (info.nodesOffset > info.positionsOffset || info.positionsOffset > info.attributesOffset ||
+				info.attributesOffset > file.Size() ||
+				info.nodesOffset + uint64_t(info.numNodes) * sizeof(BVHNode) > info.positionsOffset ||
+				info.positionsOffset + uint64_t(info.numTris) * 3 * sizeof(Vec3f) > info.attributesOffset ||
+				info.attributesOffset + uint64_t(info.numTris) * sizeof(OutOfCoreAttributes) > file.Size())
+			{
+				error = path + " is truncated or damaged";
+				return false;
+			}
+			level.bvh.nodes.resize(info.numNodes);
+			memcpy(level.bvh.nodes.data(), file.Data() + info.nodesOffset, size_t(info.numNodes) * sizeof(BVHNode));
+			// leaves index the triangles of the level in leaf order
+			if (!level.bvh.NodesValid(info.numTris))
+			{
+				error = path + " has a damaged BVH";
+				return false;
+			}
+		}
+		cache = std::unique_ptr<PageCache>(new PageCache(file, budgetBytes));
+		return true;
+	}
+
+	// Forget the finest level, its part of the file is no longer read
+	void DropFinestLevel()
+	{
+		if (levels.size() > 1) levels.erase(levels.begin());
+	}
+
+	// Returns the leaf order index of the closest hit triangle of level with tMin < t < tNear
+	bool Intersect(uint32_t level, const Vec3f &orig, const Vec3f &dir, float tMin, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+	{
+		const BVH &bvh = levels[level].bvh;
+		if (bvh.Empty()) return false;
+		const uint64_t positionsOffset = levels[level].info.positionsOffset;
+		bool intersects = false;
+		uint64_t tests = 0;
+		Vec3f block[kOutOfCoreBlockTris * 3];
+		bvh.Traverse(orig, dir, tNear, [&](uint32_t first, uint32_t count, float &tMax) {
+			// leaves only exceed the block size when the builder hit its depth limit
+			for (uint32_t start = first; start < first + count; start += kOutOfCoreBlockTris)
+			{
+				uint32_t n = std::min(kOutOfCoreBlockTris, first + count - start);
+				cache->Read(positionsOffset + uint64_t(start) * 3 * sizeof(Vec3f), n * 3 * sizeof(Vec3f), block);
+				tests += n;
+				for (uint32_t i = 0; i < n; ++i)
+				{
+					float t = kInfinity, u, v;
+					if (rayTriangleIntersect(orig, dir, block[i * 3], block[i * 3 + 1], block[i * 3 + 2], t, u, v) && t > tMin && t < tMax)
+					{
+						tMax = t;
+						uv.x = u;
+						uv.y = v;
+						triIndex = start + i;
+						intersects = true;
+					}
+				}
+			}
+		});
+		TriangleTestCounter::Get().Add(tests);
+		return intersects;
+	}
+
+	void GetTriangle(uint32_t level, uint32_t triIndex, Vec3f positions[3], Vec3f normals[3], Vec2f texCoords[3], uint32_t &sourceTriangle) const
+	{
+		const OutOfCoreLevelInfo &info = levels[level].info;
+		OutOfCoreAttributes attr;
+		cache->Read(info.positionsOffset + uint64_t(triIndex) * 3 * sizeof(Vec3f), 3 * sizeof(Vec3f), positions);
+		cache->Read(info.attributesOffset + uint64_t(triIndex) * sizeof(attr), sizeof(attr), &attr);
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			normals[k] = attr.normals[k];
+			texCoords[k] = attr.texCoords[k];
+		}
+		sourceTriangle = attr.sourceTriangle;
+	}
+
+	// Index in the source level of a leaf order triangle
+	uint32_t SourceTriangle(uint32_t level, uint32_t triIndex) const
+	{
+		OutOfCoreAttributes attr;
+		cache->Read(levels[level].info.attributesOffset + uint64_t(triIndex) * sizeof(attr), sizeof(attr), &attr);
+		return attr.sourceTriangle;
+	}
+
+	uint32_t NumLevels() const { return (uint32_t)levels.size(); }
+	const OutOfCoreLevelInfo& LevelInfo(uint32_t level) const { return levels[level].info; }
+	const MeshBounds& Bounds() const { return bounds; }
+	const std::string& Path() const { return path; }
+	PageCacheStats CacheStats() const { return cache->Stats(); }
+	uint64_t CacheBudget() const { return cache->BudgetBytes(); }
+	uint64_t FileSize() const { return file.Size(); }
+
+	uint32_t NumResidentNodes() const
+	{
+		uint32_t n = 0;
+		for (const Level &level : levels)
+			n += (uint32_t)level.bvh.nodes.size();
+		return n;
+	}
+
+	void GetMemoryUsage(MemoryUsage &usage) const
+	{
+		usage.pageCache += cache->BudgetBytes();
+		for (const Level &level : levels)
+			usage.pageCache += level.bvh.Bytes();
+	}
+};
+
+// Out-of-core files are told apart from mesh sources by their extension
+inline bool IsOutOfCoreFile(const std::string &path)
+{
+	return path.size() >= 4 && path.compare(path.size() - 4, 4, ".ooc") == 0;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Events kept per thread, older events are overwritten once a thread records more
+static const uint32_t kProfileBufferEvents = 1 << 16;
+
+struct ProfileEvent
+{
+	const char *name; // string literal, never freed
+	uint64_t start;   // ns since the profiler was enabled
+	uint64_t duration;
+	int64_t arg;      // event specific detail, -1 for none
+};
+
+// Ring of events written by a single thread. Recording only touches the owning
+// thread's buffer, so it needs no lock; head is published with release order so
+// an export after the threads are done sees complete events.
+struct ProfileBuffer
+{
+	uint32_t thread;
+	std::string name;
+	std::unique_ptr<ProfileEvent[]> events;
+	std::atomic<uint64_t> head;
+
+	ProfileBuffer(uint32_t t, const std::string &n) :
+		thread(t), name(n), events(new ProfileEvent[kProfileBufferEvents]), head(0) {}
+
+	void Record(const ProfileEvent &e)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		events[h % kProfileBufferEvents] = e;
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+// Timeline of scoped events on every thread, exported as Chrome trace-event JSON
+// (chrome://tracing, Perfetto). Off by default; a disabled scope costs one relaxed load.
+class Profiler
+{
+	typedef std::chrono::steady_clock Clock;
+
+	std::atomic<bool> enabled;
+	Clock::time_point epoch;
+	std::thread::id mainThread;
+	std::mutex mutex; // only taken when a thread records its first event
+	std::vector<std::unique_ptr<ProfileBuffer>> buffers;
+
+	Profiler() : enabled(false) {}
+
+	ProfileBuffer& ThreadBuffer()
+	{
+		thread_local ProfileBuffer *buffer = nullptr;
+		if (buffer == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			uint32_t thread = (uint32_t)buffers.size();
+			std::string name = std::this_thread::get_id() == mainThread ? "main" : "worker " + std::to_string(thread);
+			buffers.push_back(std::unique_ptr<ProfileBuffer>(new ProfileBuffer(thread, name)));
+			buffer = buffers.back().get();
+		}
+		return *buffer;
+	}
+
+public:
+	static Profiler& Get()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	void Enable()
+	{
+		epoch = Clock::now();
+		mainThread = std::this_thread::get_id();
+		enabled.store(true);
+	}
+
+	uint64_t Now() const
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+	}
+
+	void Record(const char *name, uint64_t start, uint64_t end, int64_t arg)
+	{
+		ThreadBuffer().Record(ProfileEvent{ name, start, end - start, arg });
+	}
+
+	// Write every recorded event, call when no thread is recording any more
+	bool WriteChromeTrace(const std::string &path)
+	{
+		std::ofstream ofs(path);
+		if (ofs.fail()) return false;
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t numEvents = 0, dropped = 0;
+		char line[256];
+		ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		for (const std::unique_ptr<ProfileBuffer> &buffer : buffers)
+		{
+			snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				buffer->thread == 0 ? "" : ",\n", buffer->thread, buffer->name.c_str());
+			ofs << line;
+			uint64_t head = buffer->head.load(std::memory_order_acquire);
+			uint64_t begin = head > kProfileBufferEvents ? head - kProfileBufferEvents : 0;
+			dropped += begin;
+			for (uint64_t i = begin; i < head; ++i)
+			{
+				const ProfileEvent &e = buffer->events[i % kProfileBufferEvents];
+				snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+					e.name, buffer->thread, e.start / 1000.0, e.duration / 1000.0);
+				ofs << line;
+				if (e.arg >= 0) ofs << ",\"args\":{\"n\":" << e.arg << "}";
+				ofs << "}";
+				numEvents++;
+			}
+		}
+		ofs << "\n]}\n";
+		ofs.close();
+		fprintf(stderr, "Profile: %llu events from %u threads written to %s (%llu overwritten)\n",
+			(unsigned long long)numEvents, (uint32_t)buffers.size(), path.c_str(), (unsigned long long)dropped);
+		return !ofs.fail();
+	}
+};
+
+// Records the lifetime of the scope as one event when profiling is enabled
+class ProfileScope
+{
+	const char *name;
+	int64_t arg;
+	uint64_t start;
+	bool active;
+
+public:
+	explicit ProfileScope(const char *n, int64_t a = -1) : name(n), arg(a), active(Profiler::Get().Enabled())
+	{
+		if (active) start = Profiler::Get().Now();
+	}
+	~ProfileScope() { End(); }
+
+	// Close the event before the end of the scope
+	void End()
+	{
+		if (active) Profiler::Get().Record(name, start, Profiler::Get().Now(), arg);
+		active = false;
+	}
+	ProfileScope(const ProfileScope &) = delete;
+	ProfileScope& operator = (const ProfileScope &) = delete;
+};
+
+// Enables the profiler for its lifetime and writes the trace when it goes out of scope
+class ChromeTraceSession
+{
+	std::string path;
+
+public:
+	explicit ChromeTraceSession(const std::string &p) : path(p)
+	{
+		if (!path.empty()) Profiler::Get().Enable();
+	}
+	~ChromeTraceSession()
+	{
+		if (!path.empty() && !Profiler::Get().WriteChromeTrace(path))
+			fprintf(stderr, "Cannot write profile %s\n", path.c_str());
+	}
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// PROFILE_SCOPE("name") or PROFILE_SCOPE("name", detail)
+#define PROFILE_SCOPE(...) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(__VA_ARGS__)
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstring>
+
+#include "MathHeader.h"
+
+// Most rays in one stream, a tile of the renderer
+static const uint32_t kRayStreamSize = 64;
+
+// A batch of rays in SoA form. A hit counts when tMin < t < tMax, and tMax is lowered
+// to every closer hit found, so once traced it holds the hit distance.
+struct RayStream
+{
+	uint32_t count = 0;
+	float ox[kRayStreamSize], oy[kRayStreamSize], oz[kRayStreamSize];
+	float dx[kRayStreamSize], dy[kRayStreamSize], dz[kRayStreamSize];
+	float tMin[kRayStreamSize];
+	float tMax[kRayStreamSize];
+
+	void Set(uint32_t i, const Vec3f &orig, const Vec3f &dir, float tmin = 0, float tmax = kInfinity)
+	{
+		ox[i] = orig.x; oy[i] = orig.y; oz[i] = orig.z;
+		dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+		tMin[i] = tmin;
+		tMax[i] = tmax;
+	}
+
+	Vec3f Origin(uint32_t i) const { return Vec3f(ox[i], oy[i], oz[i]); }
+	Vec3f Direction(uint32_t i) const { return Vec3f(dx[i], dy[i], dz[i]); }
+};
+
+// Closest hits of the rays of a stream. An intersect call sets hit[i] for the rays it
+// found a closer hit for and leaves the records of the other rays alone.
+struct RayHits
+{
+	uint8_t hit[kRayStreamSize];
+	uint32_t triIndex[kRayStreamSize];
+	float u[kRayStreamSize], v[kRayStreamSize];
+
+	void ClearHits(uint32_t count) { memset(hit, 0, count); }
+
+	void Set(uint32_t i, uint32_t tri, float hitU, float hitV)
+	{
+		hit[i] = 1;
+		triIndex[i] = tri;
+		u[i] = hitU;
+		v[i] = hitV;
+	}
+};
@@ -3,8 +3,16 @@
 #include <vector>
 
 #include "Geometry.h"
+#include "ImageOutput.h"
+#include "MeshInstance.h"
+#include "Profiler.h"
+#include "Texture.h"
+#include "ThreadPool.h"
 
 static const Vec3f kDefaultBackgroundColor = Vec3f(0.15f, 0.35f, 0.8f);
+// Width in pixels of the row segments handed to render threads
+static const uint32_t kTileSize = 64;
+static_assert(kTileSize <= kRayStreamSize, "a tile is traced as one ray stream");
 
 struct Options
 {
@@ -12,6 +20,26 @@ struct Options
 	uint32_t height = 480;
 	float fov = 90;
 	Vec3f backgroundColor = kDefaultBackgroundColor;
+	// Largest screen space error (pixels) allowed when picking mesh levels of detail, 0 disables
+	// LOD. Off by default: on the scenes measured so far the coarser levels cost more triangle
+	// tests per ray than full detail (see --lod-compare).
+	float lodErrorThreshold = 0;
+	// Rows rendered before they are written out, bounds the framebuffer memory
+	uint32_t bandHeight = 32;
+	// Keep the band in half floats instead of floats
+	bool halfFloatBands = false;
+	// Render threads, 0 uses every hardware thread
+	uint32_t numThreads = 0;
+	// Frames a reprojected hit may be reused for by temporal rendering before it is retraced
+	uint32_t maxReuseAge = 4;
+	// Bytes the scene and framebuffer may use, 0 for no limit. Over the budget a render
+	// fails before it starts, or degrades the scene when degradeOverBudget is set.
+	uint64_t memoryBudget = 0;
+	bool degradeOverBudget = false;
+	// Size of the texture tile cache shared by every texture
+	uint64_t textureCacheBytes = kDefaultTextureCacheBytes;
+	// Page cache of each mesh a scene file opens from an out-of-core file
+	uint64_t outOfCoreCacheBytes = 1024 * 1024;
 	Matrix4x4f cameraToWorld;
 	std::string outputName;
 };
@@ -27,7 +55,7 @@ bool Trace(
 		float tNearTriangle = kInfinity;
 		uint32_t indexTriangle;
 		Vec2f uvTriangle;
-		if (objects[k]->Intersect(origin, direction, tNearTriangle, indexTriangle, uvTriangle) && tNearTriangle < tNear) {
+		if (objects[k]->Intersect(origin, direction, 0, tNearTriangle, indexTriangle, uvTriangle) && tNearTriangle < tNear) {
 			*hitObject = objects[k].get();
 			tNear = tNearTriangle;
 			index = indexTriangle;
@@ -38,6 +66,50 @@ bool Trace(
 	return (*hitObject != nullptr);
 }
 
+// Closest hits of a stream of rays, with one intersect call per object for the whole
+// stream. hitObject[i] is nullptr for a miss, rays.tMax holds the hit distances.
+void Trace(RayStream &rays, const std::vector<std::unique_ptr<Object>> &objects, RayHits &hits, Object **hitObject)
+{
+	for (uint32_t i = 0; i < rays.count; ++i)
+		hitObject[i] = nullptr;
+	for (const auto &object : objects) {
+		hits.ClearHits(rays.count);
+		object->IntersectStream(rays, hits);
+		for (uint32_t i = 0; i < rays.count; ++i)
+			if (hits.hit[i]) hitObject[i] = object.get();
+	}
+}
+
+// Color of the surface hit at distance tnear along a ray. spreadAngle is the angle
+// a pixel covers, it picks the texture level of detail (0 samples the finest).
+Vec3f Shade(
+	const Object *hitObject,
+	const Vec3f &origin, const Vec3f &direction,
+	float tnear, uint32_t index, const Vec2f &uv,
+	float spreadAngle = 0)
+{
+	Vec3f hitPoint = origin + direction * tnear;
+	Vec3f hitNormal;
+	Vec2f hitTexCoordinates;
+	hitObject->GetSurfaceProperties(hitPoint, direction, index, uv, hitNormal, hitTexCoordinates);
+	float NdotView = std::max(0.f, hitNormal.DotProduct(-direction));
+	if (hitObject->texture)
+	{
+		// ray cone footprint against the texel density of the triangle
+		float lod = 0;
+		Vec3f p[3];
+		Vec2f st[3];
+		if (spreadAngle > 0 && hitObject->GetTriangleCorners(index, p, st))
+			lod = hitObject->texture->Lod(p, st, tnear * spreadAngle, NdotView);
+		return hitObject->texture->Sample(hitTexCoordinates, lod) * NdotView;
+	}
+	const int M = 10;
+	float checker = (fmod(hitTexCoordinates.x * M, 1.0) > 0.5) ^ (fmod(hitTexCoordinates.y * M, 1.0) < 0.5);
+	float c = 0.3 * (1 - checker) + 0.7 * checker;
+
+	return c * NdotView; //Vec3f(uv.x, uv.y, 0);
+}
+
 Vec3f CastRay(
 	const Vec3f &origin, const Vec3f &direction,
 	const std::vector<std::unique_ptr<Object>> &objects,
@@ -48,62 +120,167 @@ Vec3f CastRay(
 	Vec2f uv;
 	uint32_t index = 0;
 	Object *hitObject = nullptr;
-	if (Trace(origin, direction, objects, tnear, index, uv, &hitObject)) {
-		Vec3f hitPoint = origin + direction * tnear;
-		Vec3f hitNormal;
-		Vec2f hitTexCoordinates;
-		hitObject->GetSurfaceProperties(hitPoint, direction, index, uv, hitNormal, hitTexCoordinates);
-		float NdotView = std::max(0.f, hitNormal.DotProduct(-direction));
-		const int M = 10;
-		float checker = (fmod(hitTexCoordinates.x * M, 1.0) > 0.5) ^ (fmod(hitTexCoordinates.y * M, 1.0) < 0.5);
-		float c = 0.3 * (1 - checker) + 0.7 * checker;
-
-		hitColor = c * NdotView; //Vec3f(uv.x, uv.y, 0);
-	}
+	if (Trace(origin, direction, objects, tnear, index, uv, &hitObject))
+		hitColor = Shade(hitObject, origin, direction, tnear, index, uv, 2 * tan(deg2rad(options.fov * 0.5)) / options.height);
 
 	return hitColor;
 }
 
+// Primary ray setup shared by every pixel of a frame
+struct PrimaryRays
+{
+	Vec3f orig;
+	float scale;
+	// camera space x is the same for every row, so compute it once
+	std::unique_ptr<float[]> xs;
+	const Options &options;
+
+	PrimaryRays(const Options &opts) : options(opts)
+	{
+		scale = tan(deg2rad(options.fov * 0.5));
+		float imageAspectRatio = options.width / (float)options.height;
+		options.cameraToWorld.MultPointVec(Vec3f(0), orig);
+		xs = std::unique_ptr<float[]>(new float[options.width]);
+		for (uint32_t i = 0; i < options.width; ++i)
+			xs[i] = (2 * (i + 0.5) / (float)options.width - 1) * imageAspectRatio * scale;
+	}
+
+	// Pixels covered by one world unit at unit distance, for level of detail selection
+	float PixelsPerUnit() const { return options.height / (2 * scale); }
+	// Angle covered by a pixel, the spread of the ray cones for texture filtering
+	float SpreadAngle() const { return 1 / PixelsPerUnit(); }
+
+	uint64_t Bytes() const { return uint64_t(options.width) * sizeof(float); }
+
+	// Normalized directions of pixels [x0, x0 + count) of row j
+	void Generate(uint32_t j, uint32_t x0, uint32_t count, Vec3f *dirs) const
+	{
+		float y = (1 - 2 * (j + 0.5) / (float)options.height) * scale;
+		GenerateRayDirections(options.cameraToWorld, xs.get() + x0, y, count, dirs);
+	}
+};
+
+// Pick a level of detail per object for a frame and count the triangles of the picked levels
+void SelectLevelsOfDetail(
+	const Options &options,
+	const PrimaryRays &rays,
+	const std::vector<std::unique_ptr<Object>> &objects,
+	uint64_t &activeTris, uint64_t &fullDetailTris)
+{
+	PROFILE_SCOPE("SelectLod");
+	for (const auto &object : objects) {
+		object->SelectLevelOfDetail(rays.orig, rays.PixelsPerUnit(), options.lodErrorThreshold);
+		object->GetTriangleCounts(activeTris, fullDetailTris);
+	}
+}
+
+void PrintTextureCacheStats()
+{
+	TextureCacheStats stats = TextureCache::Get().Stats();
+	if (stats.lookups == 0) return;
+	fprintf(stderr, "Texture cache: %llu texel lookups, tile hit rate %.2f%% (%llu misses, %llu evictions), %.2f MB\n",
+		(unsigned long long)stats.lookups, 100 * stats.HitRate(), (unsigned long long)stats.misses,
+		(unsigned long long)stats.evictions, Megabytes(TextureCache::Get().BudgetBytes()));
+}
+
+// Framebuffer memory of a banded render with these options
+uint64_t FramebufferBytes(const Options &options)
+{
+	uint32_t bandHeight = std::max(1u, std::min(options.bandHeight, options.height));
+	return BandBuffer::Bytes(options.width, bandHeight, options.halfFloatBands) + uint64_t(options.width) * sizeof(float);
+}
+
+// Trace and shade pixels [x0, x0 + count) of row j as one stream into row bandRow of band
+void RenderTile(
+	const Options &options,
+	const PrimaryRays &rays,
+	const std::vector<std::unique_ptr<Object>> &objects,
+	uint32_t j, uint32_t x0, uint32_t count,
+	BandBuffer &band, uint32_t bandRow)
+{
+	Vec3f dirs[kTileSize];
+	rays.Generate(j, x0, count, dirs);
+	// the tile is traced as one stream, then shaded
+	RayStream stream;
+	stream.count = count;
+	for (uint32_t i = 0; i < count; ++i)
+		stream.Set(i, rays.orig, dirs[i]);
+	RayHits hits;
+	Object *hitObject[kTileSize];
+	ProfileScope trace("Trace");
+	Trace(stream, objects, hits, hitObject);
+	trace.End();
+	PROFILE_SCOPE("Shade");
+	for (uint32_t i = 0; i < count; ++i)
+		band.Set(x0 + i, bandRow, hitObject[i] ?
+			Shade(hitObject[i], rays.orig, dirs[i], stream.tMax[i], hits.triIndex[i], Vec2f(hits.u[i], hits.v[i]), rays.SpreadAngle()) :
+			options.backgroundColor);
+}
+
+// Render the rows of a band in tiles across the render threads. Only the band is
+// resident, so memory use does not depend on the image height.
+void RenderBand(
+	const Options &options,
+	const PrimaryRays &rays,
+	const std::vector<std::unique_ptr<Object>> &objects,
+	uint32_t firstRow, uint32_t numRows,
+	BandBuffer &band,
+	ThreadPool &pool)
+{
+	uint32_t tilesPerRow = (options.width + kTileSize - 1) / kTileSize;
+	pool.ParallelFor(tilesPerRow * numRows, [&](uint32_t task, uint32_t) {
+		PROFILE_SCOPE("Tile", firstRow * tilesPerRow + task);
+		uint32_t j = task / tilesPerRow;
+		uint32_t x0 = (task % tilesPerRow) * kTileSize;
+		RenderTile(options, rays, objects, firstRow + j, x0, std::min(kTileSize, options.width - x0), band, j);
+	});
+}
+
 void Render(
 	const Options &options,
 	const std::vector<std::unique_ptr<Object>> &objects,
 	const uint32_t &frame)
 {
-	std::unique_ptr<Vec3f[]> framebuffer(new Vec3f[options.width * options.height]);
-	Vec3f *pix = framebuffer.get();
-	float scale = tan(deg2rad(options.fov * 0.5));
-	float imageAspectRatio = options.width / (float)options.height;
-	Vec3f orig;
-	options.cameraToWorld.MultPointVec(Vec3f(0), orig);
+	PROFILE_SCOPE("Render", frame);
+	PrimaryRays rays(options);
+	uint64_t activeTris = 0, fullDetailTris = 0;
+	SelectLevelsOfDetail(options, rays, objects, activeTris, fullDetailTris);
+
+	// finished bands are quantized straight into the output file
+	std::string outputFile = FrameFileName(options.outputName, frame);
+	PpmWriter writer;
+	if (!writer.Open(outputFile, options.width, options.height)) {
+		fprintf(stderr, "Cannot open %s for writing\n", outputFile.c_str());
+		return;
+	}
+	uint32_t bandHeight = std::max(1u, std::min(options.bandHeight, options.height));
+	BandBuffer band(options.width, bandHeight, options.halfFloatBands);
+	ThreadPool &pool = GetThreadPool(options.numThreads);
+
+	uint64_t testsBefore = TriangleTestCounter::Get().Total();
 	auto timeStart = std::chrono::high_resolution_clock::now();
-	for (uint32_t j = 0; j < options.height; ++j) {
-		for (uint32_t i = 0; i < options.width; ++i) {
-			// generate primary ray direction
-			float x = (2 * (i + 0.5) / (float)options.width - 1) * imageAspectRatio * scale;
-			float y = (1 - 2 * (j + 0.5) / (float)options.height) * scale;
-			Vec3f dir;
-			options.cameraToWorld.MultDirVec(Vec3f(x, y, -1), dir);
-			dir.Normalize();
-			*(pix++) = CastRay(orig, dir, objects, options);
-		}
-		fprintf(stderr, "\r%3d%c", uint32_t(j / (float)options.height * 100), '%');
+	for (uint32_t j = 0; j < options.height; j += bandHeight) {
+		uint32_t numRows = std::min(bandHeight, options.height - j);
+		RenderBand(options, rays, objects, j, numRows, band, pool);
+		PROFILE_SCOPE("WriteBand", j);
+		writer.WriteRows(band, numRows);
+		fprintf(stderr, "\r%3d%c", uint32_t((j + numRows) / (float)options.height * 100), '%');
 	}
+	if (!writer.Close())
+		fprintf(stderr, "\nFailed writing %s\n", outputFile.c_str());
 	auto timeEnd = std::chrono::high_resolution_clock::now();
 	auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+	uint64_t tests = TriangleTestCounter::Get().Total() - testsBefore;
 	fprintf(stderr, "\rDone: %.2f (sec)\n", passedTime / 1000);
-
-	// save framebuffer to file
-	std::string outputFile = options.outputName + ".%04d.ppm";
-	char buff[256];
-	sprintf_s(buff, outputFile.c_str(), frame);
-	std::ofstream ofs;
-	ofs.open(buff);
-	ofs << "P6\n" << options.width << " " << options.height << "\n255\n";
-	for (uint32_t i = 0; i < options.height * options.width; ++i) {
-		char r = (char)(255 * clamp(0, 1, framebuffer[i].x));
-		char g = (char)(255 * clamp(0, 1, framebuffer[i].y));
-		char b = (char)(255 * clamp(0, 1, framebuffer[i].z));
-		ofs << r << g << b;
-	}
-	ofs.close();
-}
\ No newline at end of file
+	fprintf(stderr, "Triangle tests per ray: %.2f; the selected levels hold %llu of %llu full detail triangles (%.1f%%)\n",
+		tests / double(uint64_t(options.width) * options.height),
+		(unsigned long long)activeTris, (unsigned long long)fullDetailTris,
+		fullDetailTris ? 100.0 * activeTris / fullDetailTris : 100.0);
+	fprintf(stderr, "Threads: %u, band buffer: %llu bytes (%u rows%s)\n",
+		pool.NumThreads(), (unsigned long long)band.Bytes(), bandHeight, options.halfFloatBands ? ", half float" : "");
+	MemoryUsage memory = SceneMemoryUsage(objects);
+	memory.framebuffer += band.Bytes() + rays.Bytes();
+	memory.textures += TextureCache::Get().ReservedBytes();
+	PrintMemoryUsage("Memory", memory);
+	PrintTextureCacheStats();
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "Raytracer.h"
+#include "Scene.h"
+
+// One render request. Lines on the job stream look like
+//   render scene=cow.geo fov=50 res=640x480 out=cow frame=0 view=1,0,0,0,0,1,0,0,0,0,1,0,0,0,-40,1
+// where view is the world to camera (view) matrix, row major, as in main. scene is a
+// .geo file or spheres[:seed[:count[:divisions]]]. Every key but scene and out is optional.
+struct RenderJob
+{
+	uint32_t id = 0;
+	std::string scene;
+	uint32_t frame = 0;
+	Options options;
+	std::chrono::high_resolution_clock::time_point queued;
+};
+
+// Long running renderer that keeps scenes (meshes, LOD chains and BVHs) warm in a
+// content keyed cache, so jobs that only change the camera do no scene work at all.
+// Jobs are read from a stream on a separate thread and rendered in arrival order.
+// With a memory budget the cached scenes get what the job's framebuffer and the
+// texture cache leave of it, and a job whose scene alone does not fit fails up front;
+// without one the cache is bounded by kDefaultSceneCacheBytes.
+class RenderServer
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	Options defaults;
+	SceneCache cache;
+	std::mutex mutex;
+	std::condition_variable available;
+	std::deque<RenderJob> queue;
+	bool closed = false;
+
+	static double Milliseconds(Clock::time_point a, Clock::time_point b)
+	{
+		return std::chrono::duration<double, std::milli>(b - a).count();
+	}
+
+	void ReadJobs(std::istream &in)
+	{
+		std::string line;
+		uint32_t nextId = 0;
+		while (std::getline(in, line))
+		{
+			if (line.empty() || line[0] == '#') continue;
+			if (line == "quit") break;
+			RenderJob job;
+			std::string error;
+			if (!ParseJob(line, defaults, job, error))
+			{
+				std::cout << "error " << error << std::endl;
+				continue;
+			}
+			job.id = nextId++;
+			job.queued = Clock::now();
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back(std::move(job));
+			available.notify_one();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		available.notify_one();
+	}
+
+	void RunJob(const RenderJob &job)
+	{
+		Clock::time_point start = Clock::now();
+		uint64_t frameBytes = FramebufferBytes(job.options) + TextureCache::Get().ReservedBytes();
+		if (job.options.memoryBudget > 0)
+			cache.SetBudget(job.options.memoryBudget > frameBytes ? job.options.memoryBudget - frameBytes : 0);
+		bool hit;
+		std::shared_ptr<Scene> scene = cache.Get(job.scene, hit);
+		Clock::time_point sceneReady = Clock::now();
+		if (!scene)
+		{
+			std::cout << "job " << job.id << " error cannot load scene " << job.scene << std::endl;
+			return;
+		}
+		uint64_t sceneBytes = SceneMemoryUsage(scene->objects).Total();
+		if (job.options.memoryBudget > 0 && sceneBytes + frameBytes > job.options.memoryBudget)
+		{
+			// the size is only known once the scene is built, so take it back out of the
+			// cache rather than keep a scene this job's budget has no room for
+			scene.reset();
+			cache.Evict(job.scene);
+			char report[256];
+			snprintf(report, sizeof(report), "job %u error needs %.2f MB, over the %.2f MB memory budget",
+				job.id, Megabytes(sceneBytes + frameBytes), Megabytes(job.options.memoryBudget));
+			std::cout << report << std::endl;
+			return;
+		}
+		Render(job.options, scene->objects, job.frame);
+		Clock::time_point end = Clock::now();
+		char report[512];
+		snprintf(report, sizeof(report),
+			"job %u done out=%s queue_wait_ms=%.2f scene_ms=%.2f render_ms=%.2f scene_cache=%s hits=%llu misses=%llu "
+			"evictions=%llu cache_mb=%.2f",
+			job.id, FrameFileName(job.options.outputName, job.frame).c_str(),
+			Milliseconds(job.queued, start), Milliseconds(start, sceneReady), Milliseconds(sceneReady, end),
+			hit ? "hit" : "miss", (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+			(unsigned long long)cache.evictions, Megabytes(cache.Bytes()));
+		std::cout << report << std::endl;
+	}
+
+public:
+	explicit RenderServer(const Options &opts) : defaults(opts) {}
+
+	static bool ParseJob(const std::string &line, const Options &defaults, RenderJob &job, std::string &error)
+	{
+		std::stringstream ss(line);
+		std::string word;
+		ss >> word;
+		if (word != "render")
+		{
+			error = "unknown command " + word;
+			return false;
+		}
+		job.options = defaults;
+		bool hasOut = false;
+		Matrix4x4f view;
+		while (ss >> word)
+		{
+			size_t eq = word.find('=');
+			if (eq == std::string::npos)
+			{
+				error = "expected key=value, got " + word;
+				return false;
+			}
+			std::string key = word.substr(0, eq), value = word.substr(eq + 1);
+			std::stringstream vs(value);
+			char sep;
+			if (key == "scene") job.scene = value;
+			else if (key == "out")
+			{
+				job.options.outputName = value;
+				hasOut = !value.empty();
+			}
+			else if (key == "fov") vs >> job.options.fov;
+			else if (key == "frame") vs >> job.frame;
+			else if (key == "res") vs >> job.options.width >> sep >> job.options.height;
+			else if (key == "view")
+			{
+				for (uint8_t i = 0; i < 16; ++i)
+				{
+					vs >> view[i / 4][i % 4];
+					if (i < 15) vs >> sep;
+				}
+			}
+			else
+			{
+				error = "unknown key " + key;
+				return false;
+			}
+			if (vs.fail())
+			{
+				error = "bad value for " + key;
+				return false;
+			}
+		}
+		// defaults carry an output name of their own, so out has to be on the line itself
+		if (job.scene.empty() || !hasOut)
+		{
+			error = "scene and out are required";
+			return false;
+		}
+		if (job.options.width == 0 || job.options.height == 0)
+		{
+			error = "bad resolution";
+			return false;
+		}
+		job.options.cameraToWorld = view.Inverse();
+		return true;
+	}
+
+	// Serve jobs from in until it ends or a quit line is read
+	void Run(std::istream &in)
+	{
+		std::thread reader(&RenderServer::ReadJobs, this, std::ref(in));
+		while (true)
+		{
+			RenderJob job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				available.wait(lock, [&]() { return closed || !queue.empty(); });
+				if (queue.empty()) break;
+				job = std::move(queue.front());
+				queue.pop_front();
+			}
+			RunJob(job);
+		}
+		reader.join();
+		std::cout << "server done scenes_cached=" << cache.Size() << " evictions=" << cache.evictions << std::endl;
+	}
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "Raytracer.h"
+
+// A reused hit is tested for occluders up to this fraction of its distance short of it, so
+// the triangle itself and its neighbours at the shared edges do not count
+static const float kOcclusionEpsilon = 1e-5f;
+// A reprojected hit within this many pixels that lies in front of the plane of a reused
+// triangle, by more than this fraction of the hit distance, may now cover it
+static const uint32_t kOcclusionWindow = 3;
+static const float kOcclusionPlaneTolerance = 1e-3f;
+
+// What a pixel saw in the previous frame
+struct PixelHistory
+{
+	const Object *object = nullptr; // nullptr when the ray missed
+	uint32_t level = 0;             // level of detail triIndex belongs to
+	uint32_t triIndex = 0;
+	Vec3f hitPoint;
+	Vec3f color;
+	uint32_t age = 0;               // frames the hit has been carried over
+};
+
+struct TemporalStats
+{
+	uint64_t pixels = 0;
+	uint64_t reused = 0;
+	uint64_t geometry = 0;         // pixels that ended up on a surface, misses can never be reused
+	uint64_t noHistory = 0;        // disoccluded, or nothing reprojected there
+	uint64_t edges = 0;            // a neighbour reprojects from another object or from nowhere
+	uint64_t failedValidation = 0; // the pixel ray misses the reprojected triangle
+	uint64_t occlusionTests = 0;   // reuse candidates that could have become hidden, see MayBeOccluded
+	uint64_t occluded = 0;         // something in the scene is hit before the reprojected triangle
+	uint64_t expired = 0;          // previous hits dropped for reaching the maximum age
+
+	TemporalStats& operator += (const TemporalStats &s)
+	{
+		pixels += s.pixels;
+		reused += s.reused;
+		geometry += s.geometry;
+		noHistory += s.noHistory;
+		edges += s.edges;
+		failedValidation += s.failedValidation;
+		occlusionTests += s.occlusionTests;
+		occluded += s.occluded;
+		expired += s.expired;
+		return *this;
+	}
+
+	double ReuseFraction() const { return pixels ? reused / double(pixels) : 0; }
+	double GeometryReuseFraction() const { return geometry ? reused / double(geometry) : 0; }
+};
+
+// Hit data of the last rendered frame, reused when only the camera moves. Every hit is
+// forward projected into the new camera (nearest wins), and a pixel keeps its
+// reprojected hit when its own ray still hits that triangle and its neighbours came
+// from the same object. Everything else is traced from scratch.
+//
+// A reused surface can only have become hidden where something in front of it reprojects
+// next to it (a reprojected hit around the pixel lies in front of the plane of the reused
+// triangle, or nothing reprojects there), or where geometry from outside the old view can
+// have come in at the image edge. Only those pixels trace an occlusion ray through the
+// scene up to the reused hit. Anything else in front, e.g. geometry that was hidden in
+// the old view, is caught once the hit reaches Options::maxReuseAge.
+class TemporalCache
+{
+	static const uint32_t kNoSource = UINT32_MAX;
+
+	uint32_t width = 0, height = 0;
+	std::vector<const Object*> sceneObjects;
+	Matrix4x4f cameraToWorld;
+	float fov = 0;
+	std::vector<PixelHistory> history;
+	std::vector<PixelHistory> current;
+	// per pixel of the new frame: closest reprojected depth and the history pixel it came from
+	std::vector<float> depth;
+	std::vector<uint32_t> source;
+	uint32_t maxShift = 0; // largest distance in pixels a hit moved on the screen this frame
+
+	bool Matches(const Options &options, const std::vector<std::unique_ptr<Object>> &objects) const
+	{
+		if (options.width != width || options.height != height || objects.size() != sceneObjects.size())
+			return false;
+		for (size_t k = 0; k < objects.size(); ++k)
+			if (objects[k].get() != sceneObjects[k]) return false;
+		return true;
+	}
+
+	// Forward project the previous hits into the new camera
+	void Reproject(const Options &options, const PrimaryRays &rays, TemporalStats &stats)
+	{
+		PROFILE_SCOPE("Reproject");
+		std::fill(depth.begin(), depth.end(), kInfinity);
+		std::fill(source.begin(), source.end(), kNoSource);
+		maxShift = 0;
+		Matrix4x4f worldToCamera = options.cameraToWorld.Inverse();
+		float aspectScale = options.width / (float)options.height * rays.scale;
+		for (uint32_t p = 0; p < history.size(); ++p)
+		{
+			const PixelHistory &h = history[p];
+			if (h.object == nullptr) continue;
+			if (h.age >= options.maxReuseAge || h.object->ActiveLevel() != h.level)
+			{
+				stats.expired++;
+				continue;
+			}
+			Vec3f c;
+			worldToCamera.MultPointVec(h.hitPoint, c);
+			float z = -c.z;
+			if (z <= 0) continue;
+			// inverse of the pixel to camera mapping of PrimaryRays
+			float x = (c.x / z / aspectScale + 1) * 0.5f * width;
+			float y = (1 - c.y / z / rays.scale) * 0.5f * height;
+			if (!(x >= 0 && x < width && y >= 0 && y < height)) continue;
+			uint32_t q = uint32_t(y) * width + uint32_t(x);
+			maxShift = std::max(maxShift, uint32_t(std::max(std::fabs(x - p % width), std::fabs(y - p / width))) + 1);
+			if (z < depth[q])
+			{
+				depth[q] = z;
+				source[q] = p;
+			}
+		}
+	}
+
+	// Does pixel (i, j) sit inside a reprojected patch of one object
+	bool Interior(uint32_t i, uint32_t j) const
+	{
+		const Object *object = history[source[j * width + i]].object;
+		auto same = [&](uint32_t x, uint32_t y) {
+			uint32_t s = source[y * width + x];
+			return s != kNoSource && history[s].object == object;
+		};
+		return (i == 0 || same(i - 1, j)) && (i + 1 == width || same(i + 1, j)) &&
+			(j == 0 || same(i, j - 1)) && (j + 1 == height || same(i, j + 1));
+	}
+
+	// Could something now cover the reused hit of pixel (i, j), which the ray from orig
+	// meets at distance t on triangle triIndex of object
+	bool MayBeOccluded(uint32_t i, uint32_t j, const Object *object, uint32_t triIndex,
+		const Vec3f &orig, const Vec3f &hitPoint, float t) const
+	{
+		uint32_t margin = maxShift + kOcclusionWindow;
+		if (i < margin || j < margin || i + margin >= width || j + margin >= height) return true;
+		Vec3f p[3];
+		Vec2f st[3];
+		if (!object->GetTriangleCorners(triIndex, p, st)) return true;
+		Vec3f normal = (p[1] - p[0]).CrossProduct(p[2] - p[0]);
+		normal.Normalize();
+		// facing the camera, so in front of the plane is positive
+		if (normal.DotProduct(orig - hitPoint) < 0) normal = -normal;
+		float tolerance = kOcclusionPlaneTolerance * t;
+		for (uint32_t y = j - kOcclusionWindow; y <= j + kOcclusionWindow; ++y)
+		{
+			for (uint32_t x = i - kOcclusionWindow; x <= i + kOcclusionWindow; ++x)
+			{
+				uint32_t s = source[y * width + x];
+				if (s == kNoSource || normal.DotProduct(history[s].hitPoint - hitPoint) > tolerance) return true;
+			}
+		}
+		return false;
+	}
+
+	// Fill a pixel from ray i of a traced stream
+	static void StorePixel(const RayStream &rays, const RayHits &hits, Object *hitObject, uint32_t i,
+		const Options &options, float spreadAngle, PixelHistory &pixel)
+	{
+		pixel = PixelHistory();
+		pixel.color = options.backgroundColor;
+		if (hitObject == nullptr) return;
+		Vec3f orig = rays.Origin(i), dir = rays.Direction(i);
+		pixel.object = hitObject;
+		pixel.level = hitObject->ActiveLevel();
+		pixel.triIndex = hits.triIndex[i];
+		pixel.hitPoint = orig + dir * rays.tMax[i];
+		pixel.color = Shade(hitObject, orig, dir, rays.tMax[i], hits.triIndex[i], Vec2f(hits.u[i], hits.v[i]), spreadAngle);
+	}
+
+public:
+	// Per pixel history, reprojection buffers and camera rays of a frame of this size
+	static uint64_t Bytes(uint32_t w, uint32_t h)
+	{
+		return uint64_t(w) * h * (2 * sizeof(PixelHistory) + sizeof(float) + sizeof(uint32_t)) + uint64_t(w) * sizeof(float);
+	}
+
+	TemporalStats lastFrame;
+	TemporalStats total;
+	uint32_t frames = 0;
+
+	void Reset()
+	{
+		width = height = 0;
+		sceneObjects.clear();
+		history.clear();
+	}
+
+	// Render a frame reusing what the previous call saw, and write it out like Render
+	void Render(const Options &options, const std::vector<std::unique_ptr<Object>> &objects, uint32_t frame)
+	{
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		PROFILE_SCOPE("RenderTemporal", frame);
+		PrimaryRays rays(options);
+		uint64_t activeTris = 0, fullDetailTris = 0;
+		SelectLevelsOfDetail(options, rays, objects, activeTris, fullDetailTris);
+
+		if (!Matches(options, objects))
+		{
+			width = options.width;
+			height = options.height;
+			sceneObjects.clear();
+			for (const auto &object : objects)
+				sceneObjects.push_back(object.get());
+			history.assign(size_t(width) * height, PixelHistory());
+			depth.resize(history.size());
+			source.resize(history.size());
+		}
+		current.resize(history.size());
+		// a still camera sees exactly the same shading, anything else is reshaded
+		bool stillCamera = fov == options.fov;
+		for (uint8_t r = 0; r < 4; ++r)
+			for (uint8_t c = 0; c < 4; ++c)
+				stillCamera = stillCamera && cameraToWorld[r][c] == options.cameraToWorld[r][c];
+
+		lastFrame = TemporalStats();
+		Reproject(options, rays, lastFrame);
+
+		ThreadPool &pool = GetThreadPool(options.numThreads);
+		std::vector<TemporalStats> threadStats(pool.NumThreads());
+		uint32_t tilesPerRow = (width + kTileSize - 1) / kTileSize;
+		pool.ParallelFor(tilesPerRow * height, [&](uint32_t task, uint32_t thread) {
+			PROFILE_SCOPE("Tile", task);
+			TemporalStats &stats = threadStats[thread];
+			uint32_t j = task / tilesPerRow;
+			uint32_t x0 = (task % tilesPerRow) * kTileSize;
+			uint32_t count = std::min(kTileSize, width - x0);
+			Vec3f dirs[kTileSize];
+			rays.Generate(j, x0, count, dirs);
+			// pixels that cannot reuse their history are traced together as one stream
+			RayStream retrace;
+			uint32_t retracePixel[kTileSize];
+			auto queue = [&](uint32_t i) {
+				retracePixel[retrace.count] = j * width + x0 + i;
+				retrace.Set(retrace.count++, rays.orig, dirs[i]);
+			};
+			// keep the reprojected hit of pixel i, which its ray hits at t
+			auto reuse = [&](uint32_t i, float t, const Vec2f &uv) {
+				uint32_t p = j * width + x0 + i;
+				const PixelHistory &previous = history[source[p]];
+				PixelHistory &pixel = current[p];
+				stats.reused++;
+				stats.geometry++;
+				pixel = previous;
+				pixel.age = previous.age + 1;
+				pixel.hitPoint = rays.orig + dirs[i] * t;
+				if (!stillCamera)
+					pixel.color = Shade(previous.object, rays.orig, dirs[i], t, previous.triIndex, uv, rays.SpreadAngle());
+			};
+			// pixels that could have become hidden, checked for occluders as one stream
+			RayStream occlusion;
+			uint32_t occlusionPixel[kTileSize];
+			Vec2f occlusionUv[kTileSize];
+			float occlusionT[kTileSize];
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				uint32_t p = j * width + x0 + i;
+				stats.pixels++;
+				if (source[p] == kNoSource)
+				{
+					stats.noHistory++;
+					queue(i);
+					continue;
+				}
+				if (!Interior(x0 + i, j))
+				{
+					stats.edges++;
+					queue(i);
+					continue;
+				}
+				// validation ray: the pixel's own ray against the reprojected triangle only
+				const PixelHistory &previous = history[source[p]];
+				float t;
+				Vec2f uv;
+				if (!previous.object->IntersectTriangle(rays.orig, dirs[i], previous.triIndex, t, uv))
+				{
+					stats.failedValidation++;
+					queue(i);
+					continue;
+				}
+				if (!MayBeOccluded(x0 + i, j, previous.object, previous.triIndex, rays.orig, rays.orig + dirs[i] * t, t))
+				{
+					reuse(i, t, uv);
+					continue;
+				}
+				stats.occlusionTests++;
+				occlusionPixel[occlusion.count] = i;
+				occlusionUv[occlusion.count] = uv;
+				occlusionT[occlusion.count] = t;
+				occlusion.Set(occlusion.count++, rays.orig, dirs[i], 0, t * (1 - kOcclusionEpsilon));
+			}
+			// any hit short of the reprojected one, on any object, means the surface is now
+			// hidden and the pixel is retraced
+			RayHits hits;
+			Object *hitObject[kTileSize];
+			Trace(occlusion, objects, hits, hitObject);
+			for (uint32_t k = 0; k < occlusion.count; ++k)
+			{
+				if (hitObject[k] != nullptr)
+				{
+					stats.occluded++;
+					queue(occlusionPixel[k]);
+				}
+				else
+					reuse(occlusionPixel[k], occlusionT[k], occlusionUv[k]);
+			}
+			Trace(retrace, objects, hits, hitObject);
+			for (uint32_t k = 0; k < retrace.count; ++k)
+			{
+				StorePixel(retrace, hits, hitObject[k], k, options, rays.SpreadAngle(), current[retracePixel[k]]);
+				stats.geometry += hitObject[k] != nullptr;
+			}
+		});
+		for (const TemporalStats &stats : threadStats)
+			lastFrame += stats;
+		total += lastFrame;
+		frames++;
+		history.swap(current);
+		cameraToWorld = options.cameraToWorld;
+		fov = options.fov;
+
+		PROFILE_SCOPE("WriteFrame", frame);
+		std::string outputFile = FrameFileName(options.outputName, frame);
+		PpmWriter writer;
+		if (!writer.Open(outputFile, width, height))
+		{
+			fprintf(stderr, "Cannot open %s for writing\n", outputFile.c_str());
+			return;
+		}
+		writer.WriteRows(height, [&](uint32_t i, uint32_t j) { return history[size_t(j) * width + i].color; });
+		if (!writer.Close())
+			fprintf(stderr, "Failed writing %s\n", outputFile.c_str());
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		fprintf(stderr, "Frame %u: %.2f ms, reused %.1f%% of pixels, %.1f%% of surface pixels (retraced: %llu without history, "
+			"%llu at edges, %llu failed validation, %llu occluded of %llu tested; %llu hits expired)\n",
+			frame, std::chrono::duration<double, std::milli>(timeEnd - timeStart).count(),
+			100 * lastFrame.ReuseFraction(), 100 * lastFrame.GeometryReuseFraction(),
+			(unsigned long long)lastFrame.noHistory, (unsigned long long)lastFrame.edges,
+			(unsigned long long)lastFrame.failedValidation, (unsigned long long)lastFrame.occluded, (unsigned long long)lastFrame.occlusionTests,
+			(unsigned long long)lastFrame.expired);
+	}
+};
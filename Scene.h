@@ -0,0 +1,226 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "ContentHash.h"
+#include "Geometry.h"
+#include "MeshInstance.h"
+#include "Object.h"
+
+float random_float(float a, float b)
+{
+	float random = ((float)rand()) / (float)RAND_MAX;
+	float diff = b - a;
+	float r = random * diff;
+	return a + r;
+}
+
+// Everything that gets traced: meshes with their levels of detail and BVHs
+struct Scene
+{
+	std::vector<std::unique_ptr<Object>> objects;
+};
+
+struct SphereSceneParams
+{
+	int seed = 24601;
+	int numSpheres = 8;
+	int numDivisions = 6;
+	float positionVariance = 50.0f;
+	float minRadius = 0.1f;
+	float maxRadius = 10.0f;
+};
+
+// Model matrices and radii of randomly placed spheres, the same sequence for the same seed
+void PlaceSpheres(const SphereSceneParams &params, std::vector<Matrix4x4f> &modelMatrices, std::vector<float> &radii)
+{
+	srand(params.seed);
+	for (int i = 0; i < params.numSpheres; ++i)
+	{
+		Matrix4x4f modelMatrix = Matrix4x4f();
+
+		Vec3f position = Vec3f(
+			random_float(-params.positionVariance, params.positionVariance),
+			random_float(-params.positionVariance, params.positionVariance),
+			random_float(-params.positionVariance, params.positionVariance)
+		);
+		float radius = random_float(params.minRadius, params.maxRadius);
+		modelMatrix.x[3][0] = position.x;
+		modelMatrix.x[3][1] = position.y;
+		modelMatrix.x[3][2] = position.z;
+		modelMatrices.push_back(modelMatrix);
+		radii.push_back(radius);
+	}
+}
+
+// Randomly placed poly spheres
+void GenerateSphereScene(const SphereSceneParams &params, std::vector<std::unique_ptr<Object>> &objects)
+{
+	std::vector<Matrix4x4f> modelMatrices;
+	std::vector<float> radii;
+	PlaceSpheres(params, modelMatrices, radii);
+	for (size_t i = 0; i < radii.size(); ++i)
+		objects.push_back(std::unique_ptr<Object>(generatePolySphere(modelMatrices[i], radii[i], params.numDivisions)));
+}
+
+// Parse "spheres[:seed[:count[:divisions]]]"
+inline bool ParseSphereReference(const std::string &ref, SphereSceneParams &params)
+{
+	if (ref.compare(0, 7, "spheres") != 0) return false;
+	std::stringstream ss(ref.substr(7));
+	char sep;
+	if (ss >> sep) ss >> params.seed;
+	if (ss >> sep) ss >> params.numSpheres;
+	if (ss >> sep) ss >> params.numDivisions;
+	return params.numDivisions >= 2;
+}
+
+// Bytes of scenes a SceneCache keeps when no memory budget applies
+static const uint64_t kDefaultSceneCacheBytes = 512ull * 1024 * 1024;
+
+// Scenes loaded or generated so far, keyed by content rather than by name:
+// a .geo file by the hash of its bytes, a generated scene by its parameters.
+// Scenes are shared, a camera-only change renders from the cached scene as is.
+// The cache holds at most a budget of bytes (as counted by SceneMemoryUsage) and
+// evicts the least recently used scenes past it. A scene that does not fit the budget
+// on its own is not cached at all. An evicted scene lives on while a caller still
+// holds it.
+class SceneCache
+{
+	// content hash of a file, valid while its size and modification time are unchanged
+	struct FileKey
+	{
+		time_t modified;
+		off_t size;
+		uint64_t key;
+	};
+
+	struct Entry
+	{
+		std::shared_ptr<Scene> scene;
+		uint64_t bytes;
+		std::list<uint64_t>::iterator lru;
+	};
+
+	std::unordered_map<uint64_t, Entry> scenes;
+	std::list<uint64_t> lru; // most recently used first
+	std::unordered_map<std::string, FileKey> fileKeys;
+	uint64_t budgetBytes;
+	uint64_t residentBytes = 0;
+
+	void Trim()
+	{
+		while (residentBytes > budgetBytes && !lru.empty())
+		{
+			uint64_t victim = lru.back();
+			lru.pop_back();
+			residentBytes -= scenes[victim].bytes;
+			scenes.erase(victim);
+			evictions++;
+			// the file keys of an evicted scene would only ever lead to a miss
+			for (auto it = fileKeys.begin(); it != fileKeys.end();)
+				it = it->second.key == victim ? fileKeys.erase(it) : std::next(it);
+		}
+	}
+
+public:
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+
+	explicit SceneCache(uint64_t budget = kDefaultSceneCacheBytes) : budgetBytes(budget) {}
+
+	// Change the budget, evicting scenes right away if the cache is over it
+	void SetBudget(uint64_t budget)
+	{
+		budgetBytes = budget;
+		Trim();
+	}
+
+	// Content key of a scene reference, false if the reference cannot be resolved
+	bool Key(const std::string &ref, uint64_t &key)
+	{
+		SphereSceneParams params;
+		if (ParseSphereReference(ref, params))
+		{
+			std::stringstream ss;
+			ss << "spheres " << params.seed << " " << params.numSpheres << " " << params.numDivisions;
+			key = HashString(ss.str());
+			return true;
+		}
+		// only rehash a file when it changed on disk
+		struct stat st;
+		if (stat(ref.c_str(), &st) != 0) return false;
+		auto it = fileKeys.find(ref);
+		if (it != fileKeys.end() && it->second.modified == st.st_mtime && it->second.size == st.st_size)
+		{
+			key = it->second.key;
+			return true;
+		}
+		key = HashString("geo");
+		if (!HashFile(ref, key)) return false;
+		fileKeys[ref] = FileKey{ st.st_mtime, st.st_size, key };
+		return true;
+	}
+
+	// Return the cached scene for ref, building it on a miss. hit reports which one happened.
+	std::shared_ptr<Scene> Get(const std::string &ref, bool &hit)
+	{
+		uint64_t key;
+		hit = false;
+		if (!Key(ref, key)) return nullptr;
+		auto it = scenes.find(key);
+		if (it != scenes.end())
+		{
+			hits++;
+			hit = true;
+			lru.splice(lru.begin(), lru, it->second.lru);
+			return it->second.scene;
+		}
+		misses++;
+		std::shared_ptr<Scene> scene(new Scene);
+		SphereSceneParams params;
+		if (ParseSphereReference(ref, params))
+			GenerateSphereScene(params, scene->objects);
+		else
+		{
+			TriangleMesh *mesh = loadPolyMeshFromFile(Matrix4x4f(), ref.c_str());
+			if (mesh == nullptr) return nullptr;
+			scene->objects.push_back(std::unique_ptr<Object>(mesh));
+		}
+		// a scene bigger than the whole budget is handed out without evicting anything
+		uint64_t bytes = SceneMemoryUsage(scene->objects).Total();
+		if (bytes > budgetBytes) return scene;
+		lru.push_front(key);
+		scenes[key] = Entry{ scene, bytes, lru.begin() };
+		residentBytes += bytes;
+		Trim();
+		return scene;
+	}
+
+	// Drop the cached scene of ref, if there is one
+	void Evict(const std::string &ref)
+	{
+		uint64_t key;
+		if (!Key(ref, key)) return;
+		auto it = scenes.find(key);
+		if (it == scenes.end()) return;
+		lru.erase(it->second.lru);
+		residentBytes -= it->second.bytes;
+		scenes.erase(it);
+		evictions++;
+	}
+
+	size_t Size() const { return scenes.size(); }
+	uint64_t Bytes() const { return residentBytes; }
+	uint64_t BudgetBytes() const { return budgetBytes; }
+};
@@ -0,0 +1,567 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "MeshInstance.h"
+#include "OutOfCore.h"
+#include "Raytracer.h"
+#include "Scene.h"
+
+// Text scene description, one statement per line, # starts a comment:
+//
+//   view <16 floats>            world to camera matrix, row major, as in main
+//   fov <degrees>
+//   resolution <width> <height>
+//   background <r> <g> <b>
+//   output <name>
+//   lod <pixels>                Options::lodErrorThreshold
+//   band_height <rows>
+//   threads <count>
+//   half_float <0|1>
+//   memory_budget <MB> [fail|degrade]  Options::memoryBudget, fails by default
+//   texture_cache <KB>          Options::textureCacheBytes
+//   ooc_cache <KB>              Options::outOfCoreCacheBytes
+//   texture <name> <file.ppm>
+//   mesh <name> <file.geo|file.ooc>
+//   polysphere <name> <radius> <divisions>
+//   instance <name> [translate x y z] [scale s] [rotate x|y|z degrees] [matrix <16 floats>] [texture <name>]
+//   spheres <seed> <count> <divisions> [variance minRadius maxRadius]
+//
+// Meshes are defined in object space and placed by instances, transforms compose in the
+// order they are listed. spheres is the random sphere scene of GenerateSphereScene.
+// Image files are relative to the scene file like meshes, a textured instance shows
+// the texture in place of the checker pattern. A .ooc mesh is a file written by
+// --out-of-core with --keep-ooc; it is opened in place, paged through its own cache,
+// and never loaded whole.
+struct SceneMeshSource
+{
+	std::string name;
+	std::string path; // .geo or .ooc file, empty for a generated poly sphere
+	float radius = 1;
+	uint32_t divisions = 0;
+	// baked into the vertices, identity unless the mesh comes from a spheres statement
+	Matrix4x4f objectToWorld;
+};
+
+struct SceneTextureSource
+{
+	std::string name;
+	std::string path;
+};
+
+struct SceneInstance
+{
+	uint32_t mesh;
+	Matrix4x4f objectToWorld;
+	uint32_t texture = UINT32_MAX; // none
+};
+
+struct SceneDescription
+{
+	Options options;
+	std::vector<SceneMeshSource> meshes;
+	std::vector<SceneInstance> instances;
+	std::vector<SceneTextureSource> textures;
+};
+
+struct SceneLoadStats
+{
+	bool fromCache = false;
+	uint64_t key = 0;
+	double parseMs = 0;
+	double buildMs = 0; // cache load on a hit, triangulation, LOD and BVH builds on a miss
+};
+
+inline bool ParseSceneFile(const std::string &path, const Options &defaults, SceneDescription &scene, std::string &error)
+{
+	std::ifstream ifs(path);
+	if (ifs.fail())
+	{
+		error = "cannot open " + path;
+		return false;
+	}
+	std::stringstream lines;
+	lines << ifs.rdbuf();
+	scene.options = defaults;
+	// mesh files are relative to the scene file
+	size_t slash = path.find_last_of("/\\");
+	std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+	auto findMesh = [&](const std::string &name) {
+		for (uint32_t i = 0; i < scene.meshes.size(); ++i)
+			if (scene.meshes[i].name == name) return i;
+		return UINT32_MAX;
+	};
+	auto findTexture = [&](const std::string &name) {
+		for (uint32_t i = 0; i < scene.textures.size(); ++i)
+			if (scene.textures[i].name == name) return i;
+		return UINT32_MAX;
+	};
+	auto readMatrix = [](std::istream &is, Matrix4x4f &m) {
+		for (uint8_t i = 0; i < 16; ++i)
+			is >> m[i / 4][i % 4];
+	};
+
+	std::string line;
+	for (uint32_t lineNumber = 1; std::getline(lines, line); ++lineNumber)
+	{
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) line.erase(comment);
+		std::stringstream ss(line);
+		std::string word;
+		if (!(ss >> word)) continue;
+		Options &options = scene.options;
+		if (word == "view")
+		{
+			Matrix4x4f view;
+			readMatrix(ss, view);
+			options.cameraToWorld = view.Inverse();
+		}
+		else if (word == "fov") ss >> options.fov;
+		else if (word == "resolution") ss >> options.width >> options.height;
+		else if (word == "background") ss >> options.backgroundColor.x >> options.backgroundColor.y >> options.backgroundColor.z;
+		else if (word == "output") ss >> options.outputName;
+		else if (word == "lod") ss >> options.lodErrorThreshold;
+		else if (word == "band_height") ss >> options.bandHeight;
+		else if (word == "threads") ss >> options.numThreads;
+		else if (word == "half_float") ss >> options.halfFloatBands;
+		else if (word == "memory_budget")
+		{
+			double megabytes = 0;
+			std::string policy = "fail";
+			ss >> megabytes;
+			if (!ss.fail() && !(ss >> std::ws).eof())
+				ss >> policy;
+			if (policy != "fail" && policy != "degrade") ss.setstate(std::ios::failbit);
+			options.memoryBudget = uint64_t(megabytes * 1024 * 1024);
+			options.degradeOverBudget = policy == "degrade";
+		}
+		else if (word == "texture_cache")
+		{
+			uint64_t kilobytes = 0;
+			ss >> kilobytes;
+			options.textureCacheBytes = kilobytes * 1024;
+		}
+		else if (word == "ooc_cache")
+		{
+			uint64_t kilobytes = 0;
+			ss >> kilobytes;
+			options.outOfCoreCacheBytes = kilobytes * 1024;
+		}
+		else if (word == "texture")
+		{
+			SceneTextureSource texture;
+			ss >> texture.name >> texture.path;
+			texture.path = dir + texture.path;
+			if (!ss.fail() && findTexture(texture.name) != UINT32_MAX)
+			{
+				error = "line " + std::to_string(lineNumber) + ": texture " + texture.name + " defined twice";
+				return false;
+			}
+			scene.textures.push_back(texture);
+		}
+		else if (word == "mesh" || word == "polysphere")
+		{
+			SceneMeshSource mesh;
+			ss >> mesh.name;
+			if (word == "mesh")
+			{
+				ss >> mesh.path;
+				mesh.path = dir + mesh.path;
+			}
+			else ss >> mesh.radius >> mesh.divisions;
+			if (!ss.fail() && findMesh(mesh.name) != UINT32_MAX)
+			{
+				error = "line " + std::to_string(lineNumber) + ": mesh " + mesh.name + " defined twice";
+				return false;
+			}
+			scene.meshes.push_back(mesh);
+		}
+		else if (word == "instance")
+		{
+			std::string name;
+			ss >> name;
+			SceneInstance instance;
+			instance.mesh = findMesh(name);
+			if (instance.mesh == UINT32_MAX)
+			{
+				error = "line " + std::to_string(lineNumber) + ": unknown mesh " + name;
+				return false;
+			}
+			bool bad = false;
+			while (!bad && ss >> word)
+			{
+				Matrix4x4f m;
+				if (word == "translate") ss >> m[3][0] >> m[3][1] >> m[3][2];
+				else if (word == "scale")
+				{
+					float s;
+					ss >> s;
+					m[0][0] = m[1][1] = m[2][2] = s;
+				}
+				else if (word == "rotate")
+				{
+					std::string axis;
+					float degrees;
+					ss >> axis >> degrees;
+					float c = cos(deg2rad(degrees)), s = sin(deg2rad(degrees));
+					// the two rows/columns spanning the rotation plane
+					uint8_t a = axis == "x" ? 1 : axis == "y" ? 2 : 0;
+					uint8_t b = axis == "x" ? 2 : axis == "y" ? 0 : 1;
+					if (axis != "x" && axis != "y" && axis != "z") ss.setstate(std::ios::failbit);
+					m[a][a] = c; m[a][b] = s;
+					m[b][a] = -s; m[b][b] = c;
+				}
+				else if (word == "matrix") readMatrix(ss, m);
+				else if (word == "texture")
+				{
+					std::string texture;
+					ss >> texture;
+					instance.texture = findTexture(texture);
+					bad = instance.texture == UINT32_MAX;
+				}
+				else bad = true;
+				bad = bad || ss.fail();
+				instance.objectToWorld = instance.objectToWorld * m;
+			}
+			ss.clear();
+			if (bad) ss.setstate(std::ios::failbit);
+			scene.instances.push_back(instance);
+		}
+		else if (word == "spheres")
+		{
+			SphereSceneParams params;
+			ss >> params.seed >> params.numSpheres >> params.numDivisions;
+			// the placement parameters are optional, but all or none
+			if (!ss.fail() && !ss.eof() && !(ss >> std::ws).eof())
+				ss >> params.positionVariance >> params.minRadius >> params.maxRadius;
+			std::vector<Matrix4x4f> modelMatrices;
+			std::vector<float> radii;
+			PlaceSpheres(params, modelMatrices, radii);
+			for (size_t i = 0; i < radii.size(); ++i)
+			{
+				SceneMeshSource mesh;
+				mesh.name = "spheres." + std::to_string(params.seed) + "." + std::to_string(i);
+				mesh.radius = radii[i];
+				mesh.divisions = params.numDivisions;
+				mesh.objectToWorld = modelMatrices[i];
+				scene.instances.push_back(SceneInstance{ (uint32_t)scene.meshes.size(), Matrix4x4f() });
+				scene.meshes.push_back(mesh);
+			}
+		}
+		else
+		{
+			error = "line " + std::to_string(lineNumber) + ": unknown statement " + word;
+			return false;
+		}
+		if (ss.fail())
+		{
+			error = "line " + std::to_string(lineNumber) + ": bad arguments to " + word;
+			return false;
+		}
+	}
+	for (const SceneMeshSource &mesh : scene.meshes)
+	{
+		if (mesh.path.empty() && mesh.divisions < 2)
+		{
+			error = "poly sphere " + mesh.name + " needs at least 2 divisions";
+			return false;
+		}
+	}
+	return true;
+}
+
+// Version of what the scene cache stores: the triangulation, LOD and BVH builders and
+// the file layout. Bump it with any change to their output that the settings hashed
+// into SceneKey do not capture, e.g. a change to BBox::Extend or the SAH.
+static const uint32_t kSceneCacheVersion = 3;
+
+// Content key of the preprocessed meshes of a scene: the builder version and settings,
+// the mesh statements and the bytes of every mesh file they reference. Camera, options
+// and instances are not part of it, editing them does not invalidate the cache.
+inline bool SceneKey(const SceneDescription &scene, uint64_t &key, std::string &error)
+{
+	key = HashString("MRTSCN02");
+	key = HashBytes(&kSceneCacheVersion, sizeof(kSceneCacheVersion), key);
+	key = HashBytes(&kLodMinTriangles, sizeof(kLodMinTriangles), key);
+	key = HashBytes(&kBorderWeight, sizeof(kBorderWeight), key);
+	key = BVH::HashBuildSettings(BVHBuildOptions(), key);
+	for (const SceneMeshSource &mesh : scene.meshes)
+	{
+		key = HashBytes(&mesh.radius, sizeof(mesh.radius), key);
+		key = HashBytes(&mesh.divisions, sizeof(mesh.divisions), key);
+		key = HashBytes(&mesh.objectToWorld[0][0], 16 * sizeof(float), key);
+		key = HashString(mesh.path, key);
+		// nothing derived from an out-of-core file is cached, it is opened in place
+		if (mesh.path.empty() || IsOutOfCoreFile(mesh.path)) continue;
+		if (!HashFile(mesh.path, key))
+		{
+			error = "cannot read " + mesh.path;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Fully preprocessed meshes of a scene (levels of detail with their BVHs), in
+// SceneDescription::meshes order, and their binary cache file.
+//
+// File layout:
+//   SceneCacheHeader
+//   per mesh: uint32_t level count (0 for a mesh opened from an out-of-core file), then per level
+//     SceneCacheLevel, positions, indices, normals, texCoords, BVH nodes, BVH triIndices
+class CompiledScene
+{
+	struct SceneCacheHeader
+	{
+		char magic[8];
+		uint64_t key;
+		uint32_t numMeshes;
+		uint32_t reserved;
+	};
+
+	struct SceneCacheLevel
+	{
+		uint32_t numTris;
+		uint32_t numVerts;
+		float error;
+		uint32_t numNodes;
+		uint32_t numTriIndices;
+		uint32_t reserved;
+		// BVHBuildStats, spelled out so the file layout does not follow the struct
+		double bvhBuildMs;
+		uint32_t bvhNumNodes;
+		uint32_t bvhNumLeaves;
+		uint32_t bvhMaxDepth;
+		uint32_t bvhNumRefs;
+		uint32_t bvhNumSpatialSplits;
+		uint32_t reserved2;
+	};
+
+	template<typename T>
+	static void WriteArray(std::ostream &os, const T *data, size_t count)
+	{
+		os.write((const char*)data, count * sizeof(T));
+	}
+
+	template<typename T>
+	static bool ReadArray(const char *&p, const char *end, T *data, size_t count)
+	{
+		if (count > size_t(end - p) / sizeof(T)) return false;
+		memcpy(data, p, count * sizeof(T));
+		p += count * sizeof(T);
+		return true;
+	}
+
+public:
+	std::vector<std::shared_ptr<TriangleMesh>> meshes;
+
+	static TriangleMesh* OpenOutOfCore(const SceneMeshSource &source, const Options &options, std::string &error)
+	{
+		std::unique_ptr<OutOfCoreMesh> ooc(new OutOfCoreMesh);
+		if (!ooc->Open(source.path, options.outOfCoreCacheBytes, false, error)) return nullptr;
+		return new TriangleMesh(source.objectToWorld, std::move(ooc));
+	}
+
+	// Triangulate every mesh and build its LOD chain and BVHs, out-of-core files are only opened
+	bool Build(const SceneDescription &scene, std::string &error)
+	{
+		meshes.clear();
+		for (const SceneMeshSource &source : scene.meshes)
+		{
+			if (IsOutOfCoreFile(source.path))
+			{
+				TriangleMesh *mesh = OpenOutOfCore(source, scene.options, error);
+				if (mesh == nullptr) return false;
+				meshes.push_back(std::shared_ptr<TriangleMesh>(mesh));
+				continue;
+			}
+			TriangleMesh *mesh = source.path.empty() ?
+				generatePolySphere(source.objectToWorld, source.radius, source.divisions) :
+				loadPolyMeshFromFile(source.objectToWorld, source.path.c_str());
+			if (mesh == nullptr)
+			{
+				error = "cannot load " + source.path;
+				return false;
+			}
+			meshes.push_back(std::shared_ptr<TriangleMesh>(mesh));
+		}
+		return true;
+	}
+
+	bool Write(const std::string &path, uint64_t key) const
+	{
+		// write aside and rename, so a reader never sees a partial file
+		std::string tmpPath = path + ".tmp";
+		std::ofstream ofs(tmpPath, std::ios::binary);
+		if (ofs.fail()) return false;
+		SceneCacheHeader header = {};
+		memcpy(header.magic, "MRTSCN02", 8);
+		header.key = key;
+		header.numMeshes = (uint32_t)meshes.size();
+		ofs.write((const char*)&header, sizeof(header));
+		for (const std::shared_ptr<TriangleMesh> &mesh : meshes)
+		{
+			const std::vector<MeshLevel> &levels = mesh->Levels();
+			uint32_t numLevels = mesh->OutOfCore() ? 0 : (uint32_t)levels.size();
+			ofs.write((const char*)&numLevels, sizeof(numLevels));
+			for (uint32_t l = 0; l < numLevels; ++l)
+			{
+				const MeshLevel &level = levels[l];
+				SceneCacheLevel info = {};
+				info.numTris = level.numTris;
+				info.numVerts = level.numVerts;
+				info.error = level.error;
+				info.numNodes = (uint32_t)level.bvh.nodes.size();
+				info.numTriIndices = (uint32_t)level.bvh.triIndices.size();
+				info.bvhBuildMs = level.bvh.stats.buildMs;
+				info.bvhNumNodes = level.bvh.stats.numNodes;
+				info.bvhNumLeaves = level.bvh.stats.numLeaves;
+				info.bvhMaxDepth = level.bvh.stats.maxDepth;
+				info.bvhNumRefs = level.bvh.stats.numRefs;
+				info.bvhNumSpatialSplits = level.bvh.stats.numSpatialSplits;
+				ofs.write((const char*)&info, sizeof(info));
+				WriteArray(ofs, level.positions.get(), level.numVerts);
+				WriteArray(ofs, level.indices.get(), size_t(level.numTris) * 3);
+				WriteArray(ofs, level.normals.get(), size_t(level.numTris) * 3);
+				WriteArray(ofs, level.texCoords.get(), size_t(level.numTris) * 3);
+				WriteArray(ofs, level.bvh.nodes.data(), info.numNodes);
+				WriteArray(ofs, level.bvh.triIndices.data(), info.numTriIndices);
+			}
+		}
+		ofs.close();
+		if (ofs.fail()) return false;
+		remove(path.c_str());
+		return rename(tmpPath.c_str(), path.c_str()) == 0;
+	}
+
+	// Load meshes from a cache file, false if it is missing, stale (other key) or damaged
+	bool Read(const std::string &path, uint64_t key, const SceneDescription &scene)
+	{
+		meshes.clear();
+		MappedFile file;
+		if (!file.Open(path.c_str())) return false;
+		const char *p = file.Data(), *end = file.Data() + file.Size();
+		SceneCacheHeader header;
+		if (!ReadArray(p, end, &header, 1)) return false;
+		if (memcmp(header.magic, "MRTSCN02", 8) != 0 || header.key != key || header.numMeshes != scene.meshes.size())
+			return false;
+		for (uint32_t m = 0; m < header.numMeshes; ++m)
+		{
+			uint32_t numLevels;
+			if (!ReadArray(p, end, &numLevels, 1)) return false;
+			if (numLevels == 0)
+			{
+				std::string error;
+				TriangleMesh *mesh = IsOutOfCoreFile(scene.meshes[m].path) ? OpenOutOfCore(scene.meshes[m], scene.options, error) : nullptr;
+				if (mesh == nullptr) return false;
+				meshes.push_back(std::shared_ptr<TriangleMesh>(mesh));
+				continue;
+			}
+			std::vector<MeshLevel> levels(numLevels);
+			for (MeshLevel &level : levels)
+			{
+				SceneCacheLevel info;
+				if (!ReadArray(p, end, &info, 1)) return false;
+				// the counts come from the file, so check they fit in what is left of it
+				// before allocating anything
+				uint64_t numCorners = uint64_t(info.numTris) * 3;
+				uint64_t levelBytes = uint64_t(info.numVerts) * sizeof(Vec3f) +
+					numCorners * (sizeof(uint32_t) + sizeof(Vec3f) + sizeof(Vec2f)) +
+					uint64_t(info.numNodes) * sizeof(BVHNode) + uint64_t(info.numTriIndices) * sizeof(uint32_t);
+				if (levelBytes > uint64_t(end - p)) return false;
+				level.numTris = info.numTris;
+				level.numVerts = info.numVerts;
+				level.error = info.error;
+				level.positions = std::unique_ptr<Vec3f[]>(new Vec3f[info.numVerts]);
+				level.indices = std::unique_ptr<uint32_t[]>(new uint32_t[size_t(numCorners)]);
+				level.normals = std::unique_ptr<Vec3f[]>(new Vec3f[size_t(numCorners)]);
+				level.texCoords = std::unique_ptr<Vec2f[]>(new Vec2f[size_t(numCorners)]);
+				level.bvh.nodes.resize(info.numNodes);
+				level.bvh.triIndices.resize(info.numTriIndices);
+				level.bvh.stats.buildMs = info.bvhBuildMs;
+				level.bvh.stats.numNodes = info.bvhNumNodes;
+				level.bvh.stats.numLeaves = info.bvhNumLeaves;
+				level.bvh.stats.maxDepth = info.bvhMaxDepth;
+				level.bvh.stats.numRefs = info.bvhNumRefs;
+				level.bvh.stats.numSpatialSplits = info.bvhNumSpatialSplits;
+				if (!ReadArray(p, end, level.positions.get(), info.numVerts) ||
+					!ReadArray(p, end, level.indices.get(), size_t(numCorners)) ||
+					!ReadArray(p, end, level.normals.get(), size_t(numCorners)) ||
+					!ReadArray(p, end, level.texCoords.get(), size_t(numCorners)) ||
+					!ReadArray(p, end, level.bvh.nodes.data(), info.numNodes) ||
+					!ReadArray(p, end, level.bvh.triIndices.data(), info.numTriIndices))
+					return false;
+				// nothing below is trusted either: an index out of range would be read
+				// past the arrays on every ray that reaches it
+				for (uint64_t i = 0; i < numCorners; ++i)
+					if (level.indices[i] >= info.numVerts) return false;
+				for (uint32_t tri : level.bvh.triIndices)
+					if (tri >= info.numTris) return false;
+				if (!level.bvh.NodesValid(info.numTriIndices)) return false;
+			}
+			meshes.push_back(std::shared_ptr<TriangleMesh>(new TriangleMesh(scene.meshes[m].objectToWorld, std::move(levels))));
+		}
+		return p == end;
+	}
+};
+
+// Parse a scene file and build its objects, from <path>.cache when the scene and
+// its mesh files are unchanged since the cache was written, else from scratch
+// (refreshing the cache). Options not set by the file keep their defaults.
+inline bool LoadSceneFile(
+	const std::string &path,
+	const Options &defaults,
+	Options &options,
+	Scene &scene,
+	SceneLoadStats &stats,
+	std::string &error)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	Clock::time_point start = Clock::now();
+	SceneDescription description;
+	ProfileScope parse("ParseScene");
+	if (!ParseSceneFile(path, defaults, description, error)) return false;
+	if (!SceneKey(description, stats.key, error)) return false;
+	parse.End();
+	Clock::time_point parsed = Clock::now();
+
+	CompiledScene compiled;
+	std::string cachePath = path + ".cache";
+	{
+		PROFILE_SCOPE("ReadSceneCache");
+		stats.fromCache = compiled.Read(cachePath, stats.key, description);
+	}
+	if (!stats.fromCache)
+	{
+		if (!compiled.Build(description, error)) return false;
+		PROFILE_SCOPE("WriteSceneCache");
+		if (!compiled.Write(cachePath, stats.key))
+			fprintf(stderr, "Cannot write scene cache %s\n", cachePath.c_str());
+	}
+	// textures keep their own MIP file cache
+	std::vector<std::shared_ptr<Texture>> textures;
+	for (const SceneTextureSource &source : description.textures)
+	{
+		std::shared_ptr<Texture> texture(new Texture);
+		if (!texture->Load(source.path, error)) return false;
+		textures.push_back(texture);
+	}
+	for (const SceneInstance &instance : description.instances)
+	{
+		scene.objects.push_back(std::unique_ptr<Object>(new MeshInstance(compiled.meshes[instance.mesh], instance.objectToWorld)));
+		if (instance.texture != UINT32_MAX)
+			scene.objects.back()->texture = textures[instance.texture];
+	}
+	options = description.options;
+	Clock::time_point built = Clock::now();
+	stats.parseMs = std::chrono::duration<double, std::milli>(parsed - start).count();
+	stats.buildMs = std::chrono::duration<double, std::milli>(built - parsed).count();
+	return true;
+}
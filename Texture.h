@@ -0,0 +1,507 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ContentHash.h"
+#include "MathHeader.h"
+#include "OutOfCore.h"
+#include "Profiler.h"
+
+// Texels along the side of a texture tile, tiles are RGB8
+static const uint32_t kTextureTileSize = 32;
+static const uint32_t kTextureTileBytes = kTextureTileSize * kTextureTileSize * 3;
+// Texture tile cache size unless configured otherwise
+static const uint64_t kDefaultTextureCacheBytes = 4 * 1024 * 1024;
+
+// Read a binary (P6) PPM into RGB floats in [0, 1]
+inline bool LoadPpm(const std::string &path, uint32_t &width, uint32_t &height, std::vector<Vec3f> &pixels, std::string &error)
+{
+	std::ifstream ifs(path, std::ios::binary);
+	if (ifs.fail())
+	{
+		error = "cannot open " + path;
+		return false;
+	}
+	// header fields are separated by whitespace and may be followed by # comments
+	auto field = [&](uint32_t &value) {
+		while (ifs >> std::ws && ifs.peek() == '#')
+			ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		ifs >> value;
+	};
+	std::string magic;
+	uint32_t maxValue = 0;
+	ifs >> magic;
+	field(width);
+	field(height);
+	field(maxValue);
+	if (ifs.fail() || magic != "P6" || width == 0 || height == 0 || maxValue == 0 || maxValue > 65535)
+	{
+		error = path + " is not a binary PPM";
+		return false;
+	}
+	ifs.get(); // the single whitespace before the raster
+	uint32_t bytesPerSample = maxValue > 255 ? 2 : 1;
+	std::vector<unsigned char> raster(size_t(width) * height * 3 * bytesPerSample);
+	ifs.read((char*)raster.data(), raster.size());
+	if (ifs.fail())
+	{
+		error = path + " is truncated";
+		return false;
+	}
+	pixels.resize(size_t(width) * height);
+	float scale = 1.f / maxValue;
+	for (size_t i = 0; i < pixels.size(); ++i)
+	{
+		float c[3];
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			size_t s = (i * 3 + k) * bytesPerSample;
+			// 16 bit samples are big endian
+			uint32_t value = bytesPerSample == 2 ? (raster[s] << 8) | raster[s + 1] : raster[s];
+			c[k] = value * scale;
+		}
+		pixels[i] = Vec3f(c[0], c[1], c[2]);
+	}
+	return true;
+}
+
+struct TextureCacheStats
+{
+	uint64_t lookups = 0; // texels read
+	// tile fetches, neighbouring texels of a lookup in the same tile fetch it once
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+
+	double HitRate() const { return hits + misses ? hits / double(hits + misses) : 1.0; }
+};
+
+// Fixed size, thread safe LRU cache of texture tiles shared by every texture. Tiles are
+// copied in from the textures' mapped MIP files on a miss, so the resident texture
+// memory stays at the budget however many textures are bound. Slots are allocated on
+// the first lookup, a scene without textures costs nothing.
+//
+// The cache is split into shards by tile, each with its own lock, LRU list and an equal
+// share of the budget, so threads sampling different tiles do not wait on each other.
+// Small budgets get fewer shards, a shard of a handful of slots would thrash.
+class TextureCache
+{
+	static const uint32_t kMaxShards = 16;
+	static const uint32_t kMinSlotsPerShard = 16;
+
+	struct Tile
+	{
+		uint32_t slot;
+		std::list<uint64_t>::iterator lru;
+	};
+
+	struct Shard
+	{
+		mutable std::mutex mutex;
+		uint32_t numSlots = 0;
+		std::unique_ptr<unsigned char[]> slots;
+		std::vector<uint32_t> freeSlots;
+		std::unordered_map<uint64_t, Tile> tiles;
+		std::list<uint64_t> lru; // most recently used first
+		TextureCacheStats stats;
+	};
+
+	uint64_t budgetBytes = kDefaultTextureCacheBytes;
+	uint32_t numShards = NumShards(kDefaultTextureCacheBytes);
+	Shard shards[kMaxShards];
+	std::vector<const MappedFile*> files; // per texture, nullptr once released
+	mutable std::mutex filesMutex;
+
+	TextureCache() {}
+
+	// tiles are keyed by texture and tile position in its file
+	static uint64_t Key(uint32_t texture, uint64_t tileOffset) { return (uint64_t(texture) << 40) | (tileOffset / kTextureTileBytes); }
+	// neighbouring tiles, which are sampled together, land in different shards
+	uint32_t ShardOf(uint64_t key) const { return uint32_t(((key * 0x9E3779B97F4A7C15ull) >> 32) % numShards); }
+
+	static uint64_t NumSlots(uint64_t bytes) { return std::max<uint64_t>(1, bytes / kTextureTileBytes); }
+	static uint32_t NumShards(uint64_t bytes) { return (uint32_t)std::min<uint64_t>(kMaxShards, std::max<uint64_t>(1, NumSlots(bytes) / kMinSlotsPerShard)); }
+	uint32_t SlotsPerShard() const { return uint32_t(NumSlots(budgetBytes) / numShards); }
+
+	// Make a tile resident and return its texels, caller holds the shard lock
+	const unsigned char* Fetch(Shard &shard, uint64_t key, uint32_t texture, uint64_t tileOffset)
+	{
+		if (!shard.slots)
+		{
+			shard.numSlots = SlotsPerShard();
+			shard.slots = std::unique_ptr<unsigned char[]>(new unsigned char[size_t(shard.numSlots) * kTextureTileBytes]);
+			for (uint32_t i = shard.numSlots; i > 0; --i)
+				shard.freeSlots.push_back(i - 1);
+		}
+		auto it = shard.tiles.find(key);
+		if (it != shard.tiles.end())
+		{
+			shard.stats.hits++;
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+			return &shard.slots[size_t(it->second.slot) * kTextureTileBytes];
+		}
+		shard.stats.misses++;
+		uint32_t slot;
+		if (shard.freeSlots.empty())
+		{
+			uint64_t victim = shard.lru.back();
+			shard.lru.pop_back();
+			slot = shard.tiles[victim].slot;
+			shard.tiles.erase(victim);
+			shard.stats.evictions++;
+		}
+		else
+		{
+			slot = shard.freeSlots.back();
+			shard.freeSlots.pop_back();
+		}
+		const MappedFile *file;
+		{
+			std::lock_guard<std::mutex> lock(filesMutex);
+			file = files[texture];
+		}
+		unsigned char *dst = &shard.slots[size_t(slot) * kTextureTileBytes];
+		memcpy(dst, file->Data() + tileOffset, kTextureTileBytes);
+		shard.lru.push_front(key);
+		shard.tiles[key] = Tile{ slot, shard.lru.begin() };
+		return dst;
+	}
+
+public:
+	static TextureCache& Get()
+	{
+		static TextureCache cache;
+		return cache;
+	}
+
+	// Change the budget, drops every resident tile. Not to be called while sampling.
+	void SetBudget(uint64_t bytes)
+	{
+		budgetBytes = bytes;
+		numShards = NumShards(bytes);
+		for (Shard &shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.slots.reset();
+			shard.freeSlots.clear();
+			shard.tiles.clear();
+			shard.lru.clear();
+		}
+	}
+
+	uint32_t Register(const MappedFile *file)
+	{
+		std::lock_guard<std::mutex> lock(filesMutex);
+		files.push_back(file);
+		return (uint32_t)files.size() - 1;
+	}
+
+	// Forget a texture that is going away and free its tiles
+	void Release(uint32_t texture)
+	{
+		{
+			std::lock_guard<std::mutex> lock(filesMutex);
+			files[texture] = nullptr;
+		}
+		for (Shard &shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			for (auto it = shard.lru.begin(); it != shard.lru.end();)
+			{
+				if ((*it >> 40) != texture)
+				{
+					++it;
+					continue;
+				}
+				auto tile = shard.tiles.find(*it);
+				shard.freeSlots.push_back(tile->second.slot);
+				shard.tiles.erase(tile);
+				it = shard.lru.erase(it);
+			}
+		}
+	}
+
+	// Read n texels of a texture, texel k at index texels[k] of the tile at tileOffsets[k]
+	void Read(uint32_t texture, uint32_t n, const uint64_t *tileOffsets, const uint32_t *texels, Vec3f *out)
+	{
+		for (uint32_t k = 0; k < n;)
+		{
+			// neighbouring texels mostly share a tile, which is then fetched once, under
+			// the lock of its shard only
+			uint64_t key = Key(texture, tileOffsets[k]);
+			Shard &shard = shards[ShardOf(key)];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			const unsigned char *tile = Fetch(shard, key, texture, tileOffsets[k]);
+			uint32_t first = k;
+			for (; k < n && tileOffsets[k] == tileOffsets[first]; ++k)
+			{
+				const unsigned char *t = tile + texels[k] * 3;
+				out[k] = Vec3f(t[0], t[1], t[2]) * (1.f / 255);
+			}
+			shard.stats.lookups += k - first;
+		}
+	}
+
+	TextureCacheStats Stats() const
+	{
+		TextureCacheStats total;
+		for (const Shard &shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			total.lookups += shard.stats.lookups;
+			total.hits += shard.stats.hits;
+			total.misses += shard.stats.misses;
+			total.evictions += shard.stats.evictions;
+		}
+		return total;
+	}
+
+	uint64_t BudgetBytes() const { return budgetBytes; }
+	// Memory the cache holds, or will hold once textures are sampled
+	uint64_t ReservedBytes() const
+	{
+		std::lock_guard<std::mutex> lock(filesMutex);
+		bool bound = false;
+		for (const MappedFile *file : files)
+			bound = bound || file != nullptr;
+		return bound ? uint64_t(SlotsPerShard()) * numShards * kTextureTileBytes : 0;
+	}
+};
+
+// Image texture with a MIP pyramid in tiled layout, built once from a PPM and kept in
+// <image>.mip next to it. The file is mapped and read tile by tile through the
+// TextureCache, so a texture holds no texels itself. Coordinates wrap around.
+//
+// File layout:
+//   TextureHeader
+//   TextureLevelInfo per level, finest first
+//   tiles of every level, row major, kTextureTileBytes each (edge tiles padded)
+class Texture
+{
+	struct TextureHeader
+	{
+		char magic[8];
+		uint64_t key; // hash of the source image file
+		uint32_t numLevels;
+		uint32_t reserved;
+	};
+
+	struct TextureLevelInfo
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t tilesX;
+		uint32_t tilesY;
+		uint64_t offset;
+	};
+
+	std::string path;
+	MappedFile file;
+	std::vector<TextureLevelInfo> levels;
+	uint32_t id = UINT32_MAX;
+
+	static bool Write(const std::string &path, uint64_t key, uint32_t width, uint32_t height, const std::vector<Vec3f> &image)
+	{
+		// box filtered pyramid down to 1x1
+		std::vector<std::vector<Vec3f>> pyramid(1, image);
+		std::vector<TextureLevelInfo> infos(1, TextureLevelInfo{ width, height, 0, 0, 0 });
+		while (infos.back().width > 1 || infos.back().height > 1)
+		{
+			const TextureLevelInfo &fine = infos.back();
+			const std::vector<Vec3f> &src = pyramid.back();
+			uint32_t w = std::max(1u, fine.width / 2), h = std::max(1u, fine.height / 2);
+			std::vector<Vec3f> dst(size_t(w) * h);
+			for (uint32_t y = 0; y < h; ++y)
+			{
+				for (uint32_t x = 0; x < w; ++x)
+				{
+					uint32_t x0 = std::min(2 * x, fine.width - 1), x1 = std::min(2 * x + 1, fine.width - 1);
+					uint32_t y0 = std::min(2 * y, fine.height - 1), y1 = std::min(2 * y + 1, fine.height - 1);
+					dst[size_t(y) * w + x] = (src[size_t(y0) * fine.width + x0] + src[size_t(y0) * fine.width + x1] +
+						src[size_t(y1) * fine.width + x0] + src[size_t(y1) * fine.width + x1]) * 0.25f;
+				}
+			}
+			pyramid.push_back(std::move(dst));
+			infos.push_back(TextureLevelInfo{ w, h, 0, 0, 0 });
+		}
+		uint64_t offset = sizeof(TextureHeader) + infos.size() * sizeof(TextureLevelInfo);
+		// tiles are aligned to the tile size in the file
+		offset = (offset + kTextureTileBytes - 1) / kTextureTileBytes * kTextureTileBytes;
+		for (TextureLevelInfo &info : infos)
+		{
+			info.tilesX = (info.width + kTextureTileSize - 1) / kTextureTileSize;
+			info.tilesY = (info.height + kTextureTileSize - 1) / kTextureTileSize;
+			info.offset = offset;
+			offset += uint64_t(info.tilesX) * info.tilesY * kTextureTileBytes;
+		}
+
+		// write aside and rename, so a reader never sees a partial file
+		std::string tmpPath = path + ".tmp";
+		std::ofstream ofs(tmpPath, std::ios::binary);
+		if (ofs.fail()) return false;
+		TextureHeader header = {};
+		memcpy(header.magic, "MRTMIP01", 8);
+		header.key = key;
+		header.numLevels = (uint32_t)infos.size();
+		ofs.write((const char*)&header, sizeof(header));
+		ofs.write((const char*)infos.data(), infos.size() * sizeof(TextureLevelInfo));
+		std::vector<char> padding(size_t(infos[0].offset - sizeof(TextureHeader) - infos.size() * sizeof(TextureLevelInfo)), 0);
+		ofs.write(padding.data(), padding.size());
+		unsigned char tile[kTextureTileBytes];
+		for (size_t l = 0; l < infos.size(); ++l)
+		{
+			const TextureLevelInfo &info = infos[l];
+			for (uint32_t ty = 0; ty < info.tilesY; ++ty)
+			{
+				for (uint32_t tx = 0; tx < info.tilesX; ++tx)
+				{
+					memset(tile, 0, sizeof(tile));
+					for (uint32_t y = 0; y < kTextureTileSize && ty * kTextureTileSize + y < info.height; ++y)
+					{
+						for (uint32_t x = 0; x < kTextureTileSize && tx * kTextureTileSize + x < info.width; ++x)
+						{
+							const Vec3f &c = pyramid[l][size_t(ty * kTextureTileSize + y) * info.width + tx * kTextureTileSize + x];
+							unsigned char *t = tile + (y * kTextureTileSize + x) * 3;
+							t[0] = (unsigned char)(255 * clamp(0, 1, c.x) + 0.5f);
+							t[1] = (unsigned char)(255 * clamp(0, 1, c.y) + 0.5f);
+							t[2] = (unsigned char)(255 * clamp(0, 1, c.z) + 0.5f);
+						}
+					}
+					ofs.write((const char*)tile, sizeof(tile));
+				}
+			}
+		}
+		ofs.close();
+		if (ofs.fail()) return false;
+		remove(path.c_str());
+		return rename(tmpPath.c_str(), path.c_str()) == 0;
+	}
+
+	// Map the MIP file, false if it is missing, stale (other key) or damaged
+	bool Open(const std::string &mipPath, uint64_t key)
+	{
+		levels.clear();
+		if (!file.Open(mipPath.c_str())) return false;
+		TextureHeader header;
+		if (file.Size() < sizeof(header)) return false;
+		memcpy(&header, file.Data(), sizeof(header));
+		if (memcmp(header.magic, "MRTMIP01", 8) != 0 || header.key != key || header.numLevels == 0 ||
+			file.Size() < sizeof(header) + uint64_t(header.numLevels) * sizeof(TextureLevelInfo)) return false;
+		levels.resize(header.numLevels);
+		memcpy(levels.data(), file.Data() + sizeof(header), levels.size() * sizeof(TextureLevelInfo));
+		// every level must be the one Write makes for the level above it, with its tiles
+		// between the level table and the end of the file; Bilinear trusts all of it
+		uint64_t tilesStart = sizeof(header) + levels.size() * sizeof(TextureLevelInfo);
+		for (size_t l = 0; l < levels.size(); ++l)
+		{
+			const TextureLevelInfo &info = levels[l];
+			bool last = l + 1 == levels.size();
+			if (l == 0 ? info.width == 0 || info.height == 0 || info.width > INT32_MAX || info.height > INT32_MAX :
+				info.width != std::max(1u, levels[l - 1].width / 2) || info.height != std::max(1u, levels[l - 1].height / 2))
+				return false;
+			if (last != (info.width == 1 && info.height == 1)) return false;
+			if (info.tilesX != (info.width + kTextureTileSize - 1) / kTextureTileSize ||
+				info.tilesY != (info.height + kTextureTileSize - 1) / kTextureTileSize)
+				return false;
+			uint64_t bytes = uint64_t(info.tilesX) * info.tilesY * kTextureTileBytes;
+			if (info.offset < tilesStart || info.offset > file.Size() || bytes > file.Size() - info.offset) return false;
+		}
+		return true;
+	}
+
+	Vec3f Bilinear(uint32_t levelIndex, const Vec2f &st) const
+	{
+		const TextureLevelInfo &level = levels[levelIndex];
+		float x = (st.x - std::floor(st.x)) * level.width - 0.5f;
+		float y = (st.y - std::floor(st.y)) * level.height - 0.5f;
+		float fx = std::floor(x), fy = std::floor(y);
+		float wx = x - fx, wy = y - fy;
+		int32_t xs[2] = { (int32_t)fx, (int32_t)fx + 1 }, ys[2] = { (int32_t)fy, (int32_t)fy + 1 };
+		uint64_t tileOffsets[4];
+		uint32_t texels[4];
+		for (uint32_t k = 0; k < 4; ++k)
+		{
+			// wrap around
+			uint32_t tx = uint32_t((xs[k & 1] + (int32_t)level.width) % (int32_t)level.width);
+			uint32_t ty = uint32_t((ys[k >> 1] + (int32_t)level.height) % (int32_t)level.height);
+			tileOffsets[k] = level.offset + (uint64_t(ty / kTextureTileSize) * level.tilesX + tx / kTextureTileSize) * kTextureTileBytes;
+			texels[k] = (ty % kTextureTileSize) * kTextureTileSize + tx % kTextureTileSize;
+		}
+		Vec3f c[4];
+		TextureCache::Get().Read(id, 4, tileOffsets, texels, c);
+		return (c[0] * (1 - wx) + c[1] * wx) * (1 - wy) + (c[2] * (1 - wx) + c[3] * wx) * wy;
+	}
+
+public:
+	Texture() {}
+	Texture(const Texture &) = delete;
+	Texture& operator = (const Texture &) = delete;
+	~Texture()
+	{
+		if (id != UINT32_MAX) TextureCache::Get().Release(id);
+	}
+
+	// Load a PPM, building its MIP file unless an up to date one exists
+	bool Load(const std::string &imagePath, std::string &error)
+	{
+		PROFILE_SCOPE("LoadTexture");
+		uint64_t key = HashString("mip");
+		if (!HashFile(imagePath, key))
+		{
+			error = "cannot open " + imagePath;
+			return false;
+		}
+		path = imagePath + ".mip";
+		if (!Open(path, key))
+		{
+			file.Close();
+			uint32_t width, height;
+			std::vector<Vec3f> image;
+			if (!LoadPpm(imagePath, width, height, image, error)) return false;
+			if (!Write(path, key, width, height, image) || !Open(path, key))
+			{
+				error = "cannot write " + path;
+				return false;
+			}
+		}
+		id = TextureCache::Get().Register(&file);
+		return true;
+	}
+
+	uint32_t Width() const { return levels[0].width; }
+	uint32_t Height() const { return levels[0].height; }
+	uint32_t NumLevels() const { return (uint32_t)levels.size(); }
+
+	// Level of detail for a ray cone of width coneWidth hitting triangle p (world space)
+	// with texture coordinates st, at cosine cosine to its normal: log2 of the texels of
+	// the finest level the footprint covers
+	float Lod(const Vec3f p[3], const Vec2f st[3], float coneWidth, float cosine) const
+	{
+		float worldArea = (p[1] - p[0]).CrossProduct(p[2] - p[0]).Length();
+		Vec2f a = st[1] - st[0], b = st[2] - st[0];
+		float texelArea = std::fabs(a.x * b.y - a.y * b.x) * Width() * Height();
+		if (worldArea <= 0 || texelArea <= 0 || coneWidth <= 0) return 0;
+		return 0.5f * std::log2(texelArea / worldArea) + std::log2(coneWidth / std::max(cosine, 1e-3f));
+	}
+
+	// Trilinear lookup between the two levels around lod
+	Vec3f Sample(const Vec2f &st, float lod) const
+	{
+		float maxLod = float(levels.size() - 1);
+		lod = clamp(0, maxLod, lod);
+		uint32_t l0 = (uint32_t)lod;
+		float w = lod - l0;
+		Vec3f c = Bilinear(l0, st);
+		if (w > 0 && l0 + 1 < levels.size())
+			c = c * (1 - w) + Bilinear(l0 + 1, st) * w;
+		return c;
+	}
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run the tasks of one ParallelFor at a time.
+// The calling thread takes part as thread 0, workers are threads 1..n-1.
+class ThreadPool
+{
+	typedef std::function<void(uint32_t task, uint32_t thread)> Job;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const Job *job = nullptr;
+	uint32_t jobSize = 0;
+	std::atomic<uint32_t> nextTask;
+	uint32_t generation = 0;
+	uint32_t active = 0;
+	bool stop = false;
+
+	void RunTasks(uint32_t thread)
+	{
+		uint32_t task;
+		while ((task = nextTask++) < jobSize)
+			(*job)(task, thread);
+	}
+
+	void WorkerLoop(uint32_t thread)
+	{
+		uint32_t seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stop || generation != seen; });
+				if (stop) return;
+				seen = generation;
+			}
+			RunTasks(thread);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--active == 0) done.notify_all();
+		}
+	}
+
+public:
+	// numThreads = 0 uses one thread per hardware thread
+	explicit ThreadPool(uint32_t numThreads = 0) : nextTask(0)
+	{
+		if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (uint32_t i = 1; i < numThreads; ++i)
+			workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool& operator = (const ThreadPool &) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread &worker : workers)
+			worker.join();
+	}
+
+	uint32_t NumThreads() const { return (uint32_t)workers.size() + 1; }
+
+	// Run fn(task, thread) for every task in [0, count) and wait for all of them
+	void ParallelFor(uint32_t count, const Job &fn)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &fn;
+			jobSize = count;
+			nextTask = 0;
+			active = (uint32_t)workers.size();
+			generation++;
+		}
+		wake.notify_all();
+		RunTasks(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&]() { return active == 0; });
+		job = nullptr;
+	}
+};
+
+// Shared pool for rendering, recreated when a different thread count is asked for
+inline ThreadPool& GetThreadPool(uint32_t numThreads)
+{
+	static std::unique_ptr<ThreadPool> pool;
+	uint32_t wanted = numThreads ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+	if (!pool || pool->NumThreads() != wanted)
+		pool = std::unique_ptr<ThreadPool>(new ThreadPool(wanted));
+	return *pool;
+}
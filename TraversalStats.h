@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Ray-triangle tests made by the intersect paths, counted per thread. A thread only
+// writes its own slot, so counting needs no lock or atomic add; Total() is exact once
+// the threads that traced are done, e.g. after a ParallelFor.
+class TriangleTestCounter
+{
+	struct Slot
+	{
+		std::atomic<uint64_t> tests;
+		char padding[64 - sizeof(std::atomic<uint64_t>)]; // keep slots on their own cache line
+		Slot() : tests(0) {}
+	};
+
+	std::mutex mutex; // only taken the first time a thread counts, and by Total
+	std::vector<std::unique_ptr<Slot>> slots;
+
+	TriangleTestCounter() {}
+
+	Slot& ThreadSlot()
+	{
+		thread_local Slot *slot = nullptr;
+		if (slot == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slots.push_back(std::unique_ptr<Slot>(new Slot));
+			slot = slots.back().get();
+		}
+		return *slot;
+	}
+
+public:
+	static TriangleTestCounter& Get()
+	{
+		static TriangleTestCounter counter;
+		return counter;
+	}
+
+	void Add(uint64_t tests)
+	{
+		if (tests == 0) return;
+		Slot &slot = ThreadSlot();
+		slot.tests.store(slot.tests.load(std::memory_order_relaxed) + tests, std::memory_order_relaxed);
+	}
+
+	// Tests counted so far by every thread, take the difference of two calls to count a pass
+	uint64_t Total()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t total = 0;
+		for (const auto &slot : slots)
+			total += slot->tests.load(std::memory_order_relaxed);
+		return total;
+	}
+};
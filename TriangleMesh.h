@@ -3,18 +3,23 @@
 #include <memory>
 
 #include "MathHeader.h"
+#include "MeshLod.h"
 #include "Object.h"
+#include "OutOfCore.h"
+#include "Profiler.h"
 
 #define MT_ALGO true;
 
 class TriangleMesh : public Object
 {
 	// member variables
-	uint32_t numTris;
-	std::unique_ptr<Vec3f[]> positions;
-	std::unique_ptr<uint32_t[]> indices;
-	std::unique_ptr<Vec3f[]> normals;
-	std::unique_ptr<Vec2f[]> texCoords;
+	// levels[0] is the full detail mesh, later levels are progressively coarser
+	std::vector<MeshLevel> levels;
+	uint32_t activeLevel = 0;
+	// world space bounds of the full detail level, the sphere picks a level of detail
+	MeshBounds bounds;
+	// set when the levels live in a file, levels then only hold their counts
+	std::unique_ptr<OutOfCoreMesh> outOfCore;
 
 public:
 	// Build a triangle mesh from a face index array and a vertex index array
@@ -25,8 +30,11 @@ public:
 		const std::unique_ptr<uint32_t[]> &vertsIndex,
 		const std::unique_ptr<Vec3f[]> &verts,
 		std::unique_ptr<Vec3f[]> &n,
-		std::unique_ptr<Vec2f[]> &st) : Object(o2w), numTris(0)
+		std::unique_ptr<Vec2f[]> &st) : Object(o2w), levels(1)
 	{
+		ProfileScope triangulate("Triangulate", nFaces);
+		MeshLevel &level = levels[0];
+		uint32_t &numTris = level.numTris;
 		uint32_t k = 0, maxVertexIndex = 0;
 		// determine number of triangles in mesh
 		for (uint32_t i = 0; i < nFaces; ++i)
@@ -43,18 +51,18 @@ public:
 		maxVertexIndex += 1; // count = index + 1
 
 		// allocate memory to store the position of the mesh vertices
-		positions = std::unique_ptr<Vec3f[]>(new Vec3f[maxVertexIndex]);
-		for (uint32_t i = 0; i < maxVertexIndex; ++i)
-		{
-			//positions[i] = verts[i];
-			objectToWorld.MultPointVec(verts[i], positions[i]);
-		}
+		level.numVerts = maxVertexIndex;
+		level.positions = std::unique_ptr<Vec3f[]>(new Vec3f[maxVertexIndex]);
+		objectToWorld.MultPointVecs(verts.get(), level.positions.get(), maxVertexIndex);
 		// allocate memory to store triangle indices
-		indices = std::unique_ptr<uint32_t[]>(new uint32_t[numTris * 3]);
+		level.indices = std::unique_ptr<uint32_t[]>(new uint32_t[numTris * 3]);
 		uint32_t l = 0;
 		// generate triangle index array
-		normals = std::unique_ptr<Vec3f[]>(new Vec3f[numTris * 3]);
-		texCoords = std::unique_ptr<Vec2f[]>(new Vec2f[numTris * 3]);
+		level.normals = std::unique_ptr<Vec3f[]>(new Vec3f[numTris * 3]);
+		level.texCoords = std::unique_ptr<Vec2f[]>(new Vec2f[numTris * 3]);
+		uint32_t *indices = level.indices.get();
+		Vec3f *normals = level.normals.get();
+		Vec2f *texCoords = level.texCoords.get();
 		// for each face
 		for (uint32_t i = 0, k = 0; i < nFaces; ++i)
 		{
@@ -78,12 +86,313 @@ public:
 		// you can use move if the input geometry is already triangulated
 		//N = std::move(normals); // transfer ownership
 		//sts = std::move(st); // transfer ownership
+
+		ComputeBounds();
+		triangulate.End();
+		// coarser levels of detail
+		{
+			PROFILE_SCOPE("BuildLod", numTris);
+			std::vector<MeshLevel> chain = MeshSimplifier::BuildChain(level);
+			for (MeshLevel &coarse : chain)
+				levels.push_back(std::move(coarse));
+		}
+		for (MeshLevel &lod : levels)
+			lod.BuildBVH();
+	}
+
+	// Adopt already triangulated levels (with their BVHs), e.g. from a compiled scene
+	TriangleMesh(const Matrix4x4f &o2w, std::vector<MeshLevel> &&lods) : Object(o2w), levels(std::move(lods))
+	{
+		ComputeBounds();
+	}
+
+	// Adopt the levels of an opened out-of-core file without loading them
+	TriangleMesh(const Matrix4x4f &o2w, std::unique_ptr<OutOfCoreMesh> &&ooc) : Object(o2w), outOfCore(std::move(ooc))
+	{
+		levels.resize(outOfCore->NumLevels());
+		for (uint32_t i = 0; i < levels.size(); ++i)
+		{
+			const OutOfCoreMesh::OutOfCoreLevelInfo &info = outOfCore->LevelInfo(i);
+			levels[i].numTris = info.numTris;
+			levels[i].numVerts = info.numVerts;
+			levels[i].error = info.error;
+		}
+		bounds = outOfCore->Bounds();
+	}
+
+	const std::vector<MeshLevel>& Levels() const { return levels; }
+
+	// Move every level of detail into a file at path, read through a page cache of
+	// budgetBytes. The file is scratch space removed with the mesh unless keepFile is
+	// set, in which case a later run can open it without loading the mesh.
+	bool MoveOutOfCore(const std::string &path, uint64_t budgetBytes, bool keepFile = false)
+	{
+		std::string error;
+		std::unique_ptr<OutOfCoreMesh> ooc(new OutOfCoreMesh);
+		if (!OutOfCoreMesh::Write(levels, bounds, path, error) || !ooc->Open(path, budgetBytes, !keepFile, error))
+		{
+			if (!keepFile) remove(path.c_str());
+			return false;
+		}
+		outOfCore = std::move(ooc);
+		// release everything but the counts
+		for (MeshLevel &level : levels)
+		{
+			level.positions.reset();
+			level.indices.reset();
+			level.normals.reset();
+			level.texCoords.reset();
+			level.bvh = BVH();
+		}
+		return true;
+	}
+
+	const OutOfCoreMesh* OutOfCore() const { return outOfCore.get(); }
+
+	// Release the per corner normals of every level. Shading uses face normals, so
+	// this only costs the data an out-of-core file would carry along.
+	uint64_t DropNormals()
+	{
+		uint64_t bytes = 0;
+		for (MeshLevel &level : levels)
+		{
+			if (level.normals) bytes += uint64_t(level.numTris) * 3 * sizeof(Vec3f);
+			level.normals.reset();
+		}
+		return bytes;
+	}
+
+	// Rebuild the BVH of every level held in memory, e.g. with spatial splits
+	void RebuildBVHs(const BVHBuildOptions &options)
+	{
+		if (outOfCore) return;
+		for (MeshLevel &level : levels)
+			level.BuildBVH(options);
+	}
+
+	// Release the full detail level, the next coarser one takes its place. Fails when
+	// only one level is left.
+	bool DropFinestLevel()
+	{
+		if (levels.size() < 2) return false;
+		levels.erase(levels.begin());
+		if (outOfCore) outOfCore->DropFinestLevel();
+		activeLevel = 0;
+		return true;
+	}
+
+	void GetMemoryUsage(MemoryUsage &usage) const
+	{
+		usage.objects += sizeof(TriangleMesh);
+		for (const MeshLevel &level : levels)
+			level.GetMemoryUsage(usage);
+		if (outOfCore) outOfCore->GetMemoryUsage(usage);
+	}
+
+	// Triangle of the source level for a triIndex reported by Intersect, which is in
+	// leaf order rather than source order for an out-of-core mesh
+	uint32_t SourceTriangle(uint32_t levelIndex, uint32_t triIndex) const
+	{
+		return outOfCore ? outOfCore->SourceTriangle(levelIndex, triIndex) : triIndex;
+	}
+
+	// Bounding sphere of the full detail mesh (centered on the box center)
+	void ComputeBounds()
+	{
+		const MeshLevel &level = levels[0];
+		if (level.numVerts == 0) return;
+		Vec3f lo = level.positions[0], hi = level.positions[0];
+		for (uint32_t i = 1; i < level.numVerts; ++i)
+		{
+			const Vec3f &p = level.positions[i];
+			lo = Vec3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+			hi = Vec3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+		}
+		bounds.lo = lo;
+		bounds.hi = hi;
+		bounds.center = (lo + hi) * 0.5f;
+		bounds.radius = 0;
+		for (uint32_t i = 0; i < level.numVerts; ++i)
+			bounds.radius = std::max(bounds.radius, (level.positions[i] - bounds.center).Length());
+	}
+
+	// The coarsest level whose error projects to at most errorThreshold pixels
+	uint32_t PickLevel(const Vec3f &eye, float pixelsPerUnit, float errorThreshold) const
+	{
+		uint32_t pick = 0;
+		if (errorThreshold <= 0) return pick;
+		// distance to the nearest point of the bounding sphere
+		float distance = (bounds.center - eye).Length() - bounds.radius;
+		if (distance <= 0) return pick;
+		for (uint32_t i = 1; i < levels.size(); ++i)
+		{
+			if (levels[i].error * pixelsPerUnit / distance > errorThreshold) break;
+			pick = i;
+		}
+		return pick;
+	}
+
+	void SelectLevelOfDetail(const Vec3f &eye, float pixelsPerUnit, float errorThreshold)
+	{
+		activeLevel = PickLevel(eye, pixelsPerUnit, errorThreshold);
+	}
+
+	uint32_t ActiveLevel() const { return activeLevel; }
+
+	void GetTriangleCounts(uint64_t &active, uint64_t &fullDetail) const
+	{
+		active += levels[activeLevel].numTris;
+		fullDetail += levels[0].numTris;
 	}
 
 	// Test if ray intersects this triangle mesh
-	bool Intersect(const Vec3f &orig, const Vec3f &dir, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+	bool Intersect(const Vec3f &orig, const Vec3f &dir, float tMin, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+	{
+		return IntersectLevel(activeLevel, orig, dir, tMin, tNear, triIndex, uv);
+	}
+
+	void IntersectStream(RayStream &rays, RayHits &hits) const
+	{
+		IntersectStreamLevel(activeLevel, rays, hits);
+	}
+
+	bool IntersectTriangle(const Vec3f &orig, const Vec3f &dir, uint32_t triIndex, float &t, Vec2f &uv) const
+	{
+		return IntersectTriangleLevel(activeLevel, orig, dir, triIndex, t, uv);
+	}
+
+	bool IntersectTriangleLevel(uint32_t levelIndex, const Vec3f &orig, const Vec3f &dir, uint32_t triIndex, float &t, Vec2f &uv) const
+	{
+		Vec3f p[3];
+		if (outOfCore)
+		{
+			Vec3f n[3];
+			Vec2f st[3];
+			uint32_t sourceTriangle;
+			outOfCore->GetTriangle(levelIndex, triIndex, p, n, st, sourceTriangle);
+		}
+		else
+		{
+			const MeshLevel &level = levels[levelIndex];
+			for (uint32_t k = 0; k < 3; ++k)
+				p[k] = level.positions[level.indices[triIndex * 3 + k]];
+		}
+		TriangleTestCounter::Get().Add(1);
+		return rayTriangleIntersect(orig, dir, p[0], p[1], p[2], t, uv.x, uv.y);
+	}
+
+	// Intersect against a given level of detail rather than the selected one
+	bool IntersectLevel(uint32_t levelIndex, const Vec3f &orig, const Vec3f &dir, float tMin, float &tNear, uint32_t &triIndex, Vec2f &uv) const
+	{
+		if (outOfCore)
+			return outOfCore->Intersect(levelIndex, orig, dir, tMin, tNear, triIndex, uv);
+
+		const MeshLevel &level = levels[levelIndex];
+		if (level.bvh.Empty())
+			return IntersectLinear(level, orig, dir, tMin, tNear, triIndex, uv);
+
+		const Vec3f *positions = level.positions.get();
+		const uint32_t *indices = level.indices.get();
+		const uint32_t *triIndices = level.bvh.triIndices.data();
+		bool intersects = false;
+		uint64_t tests = 0;
+		level.bvh.Traverse(orig, dir, tNear, [&](uint32_t first, uint32_t count, float &tMax) {
+			tests += count;
+			for (uint32_t i = first; i < first + count; ++i)
+			{
+				uint32_t tri = triIndices[i];
+				const Vec3f &v0 = positions[indices[tri * 3]];
+				const Vec3f &v1 = positions[indices[tri * 3 + 1]];
+				const Vec3f &v2 = positions[indices[tri * 3 + 2]];
+				float t = kInfinity, u, v;
+				if (rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t > tMin && t < tMax)
+				{
+					tMax = t;
+					uv.x = u;
+					uv.y = v;
+					triIndex = tri;
+					intersects = true;
+				}
+			}
+		});
+		TriangleTestCounter::Get().Add(tests);
+		return intersects;
+	}
+
+	// Intersect a stream of rays against a given level of detail. The BVH is walked once
+	// for the whole stream, and each triangle of a leaf is fetched once for all the rays
+	// that reached the leaf.
+	void IntersectStreamLevel(uint32_t levelIndex, RayStream &rays, RayHits &hits) const
+	{
+		if (outOfCore)
+		{
+			// the page cache is read per ray
+			for (uint32_t i = 0; i < rays.count; ++i)
+			{
+				float tNear = rays.tMax[i];
+				uint32_t triIndex;
+				Vec2f uv;
+				if (outOfCore->Intersect(levelIndex, rays.Origin(i), rays.Direction(i), rays.tMin[i], tNear, triIndex, uv))
+				{
+					rays.tMax[i] = tNear;
+					hits.Set(i, triIndex, uv.x, uv.y);
+				}
+			}
+			return;
+		}
+
+		const MeshLevel &level = levels[levelIndex];
+		const Vec3f *positions = level.positions.get();
+		const uint32_t *indices = level.indices.get();
+		Vec3f orig[kRayStreamSize], dir[kRayStreamSize];
+		for (uint32_t i = 0; i < rays.count; ++i)
+		{
+			orig[i] = rays.Origin(i);
+			dir[i] = rays.Direction(i);
+		}
+		uint64_t tests = 0;
+		auto testTriangle = [&](uint32_t tri, const uint32_t *active, uint32_t numActive) {
+			tests += numActive;
+			const Vec3f &v0 = positions[indices[tri * 3]];
+			Vec3f edge0_1 = positions[indices[tri * 3 + 1]] - v0;
+			Vec3f edge1_2 = positions[indices[tri * 3 + 2]] - v0;
+			for (uint32_t k = 0; k < numActive; ++k)
+			{
+				uint32_t r = active[k];
+				float t, u, v;
+				if (rayTriangleIntersectEdges(orig[r], dir[r], v0, edge0_1, edge1_2, t, u, v) && t > rays.tMin[r] && t < rays.tMax[r])
+				{
+					rays.tMax[r] = t;
+					hits.Set(r, tri, u, v);
+				}
+			}
+		};
+		if (level.bvh.Empty())
+		{
+			uint32_t all[kRayStreamSize];
+			for (uint32_t i = 0; i < rays.count; ++i)
+				all[i] = i;
+			for (uint32_t tri = 0; tri < level.numTris; ++tri)
+				testTriangle(tri, all, rays.count);
+			TriangleTestCounter::Get().Add(tests);
+			return;
+		}
+		const uint32_t *triIndices = level.bvh.triIndices.data();
+		level.bvh.TraverseStream(rays, [&](uint32_t first, uint32_t count, const uint32_t *active, uint32_t numActive) {
+			for (uint32_t i = first; i < first + count; ++i)
+				testTriangle(triIndices[i], active, numActive);
+		});
+		TriangleTestCounter::Get().Add(tests);
+	}
+
+	// Test every triangle of level, the reference for the accelerated paths
+	static bool IntersectLinear(const MeshLevel &level, const Vec3f &orig, const Vec3f &dir, float tMin, float &tNear, uint32_t &triIndex, Vec2f &uv)
 	{
 #if MT_ALGO
+		const uint32_t numTris = level.numTris;
+		TriangleTestCounter::Get().Add(numTris);
+		const Vec3f *positions = level.positions.get();
+		const uint32_t *indices = level.indices.get();
 		uint32_t j = 0;
 		bool intersects = false;
 		for (uint32_t i = 0; i < numTris; ++i)
@@ -92,7 +401,7 @@ public:
 			const Vec3f &v1 = positions[indices[j + 1]];
 			const Vec3f &v2 = positions[indices[j + 2]];
 			float t = kInfinity, u, v;
-			if (rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t < tNear)
+			if (rayTriangleIntersect(orig, dir, v0, v1, v2, t, u, v) && t > tMin && t < tNear)
 			{
 				tNear = t;
 				uv.x = u;
@@ -118,6 +427,66 @@ public:
 		Vec3f &hitNormal,
 		Vec2f &hitTextureCoordinates) const
 	{
+		GetSurfacePropertiesLevel(activeLevel, triIndex, uv, hitNormal, hitTextureCoordinates);
+	}
+
+	// Bounds of the full detail level, coarser levels stay inside them
+	bool GetWorldBounds(Vec3f &lo, Vec3f &hi) const
+	{
+		if (levels.empty() || levels[0].numTris == 0) return false;
+		lo = bounds.lo;
+		hi = bounds.hi;
+		return true;
+	}
+
+	bool GetTriangleCorners(uint32_t triIndex, Vec3f p[3], Vec2f st[3]) const
+	{
+		GetTriangleCornersLevel(activeLevel, triIndex, p, st);
+		return true;
+	}
+
+	void GetTriangleCornersLevel(uint32_t levelIndex, uint32_t triIndex, Vec3f p[3], Vec2f st[3]) const
+	{
+		if (outOfCore)
+		{
+			Vec3f n[3];
+			uint32_t sourceTriangle;
+			outOfCore->GetTriangle(levelIndex, triIndex, p, n, st, sourceTriangle);
+			return;
+		}
+		const MeshLevel &level = levels[levelIndex];
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			p[k] = level.positions[level.indices[triIndex * 3 + k]];
+			st[k] = level.texCoords[triIndex * 3 + k];
+		}
+	}
+
+	// Surface properties of a triangle of a given level of detail
+	void GetSurfacePropertiesLevel(
+		uint32_t levelIndex,
+		const uint32_t &triIndex,
+		const Vec2f &uv,
+		Vec3f &hitNormal,
+		Vec2f &hitTextureCoordinates) const
+	{
+		if (outOfCore)
+		{
+			Vec3f p[3], n[3];
+			Vec2f st[3];
+			uint32_t sourceTriangle;
+			outOfCore->GetTriangle(levelIndex, triIndex, p, n, st, sourceTriangle);
+			hitNormal = (p[1] - p[0]).CrossProduct(p[2] - p[0]);
+			hitNormal.Normalize();
+			hitTextureCoordinates = (1 - uv.x - uv.y) * st[0] + uv.x * st[1] + uv.y * st[2];
+			return;
+		}
+
+		const MeshLevel &level = levels[levelIndex];
+		const Vec3f *positions = level.positions.get();
+		const uint32_t *indices = level.indices.get();
+		const Vec2f *texCoords = level.texCoords.get();
+
 		//// vertex normal
 		//const Vec3f &n0 = normals[triIndex * 3];
 		//const Vec3f &n1 = normals[triIndex * 3 + 1];
@@ -0,0 +1,451 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MeshInstance.h"
+#include "Raytracer.h"
+
+// Closest hit of a ray, with the triangle in source order of the full detail mesh
+struct RayHit
+{
+	int32_t object = -1; // -1 for a miss
+	uint32_t triIndex = 0;
+	float t = kInfinity;
+	Vec2f uv;
+
+	// Smallest barycentric coordinate, near 0 when the hit is on a triangle edge
+	float EdgeDistance() const { return std::min(std::min(uv.x, uv.y), 1 - uv.x - uv.y); }
+};
+
+struct ValidationTolerance
+{
+	float t = 1e-4f;    // relative to max(1, t, |origin|), instance transforms lose precision far from the origin
+	float uv = 1e-3f;
+	// hits this close to a triangle edge may land on the neighbouring triangle, or
+	// miss at a silhouette, without counting as a mismatch
+	float edge = 1e-3f;
+};
+
+struct ValidationRay
+{
+	Vec3f orig;
+	Vec3f dir;
+	std::string label; // pixel or fuzz case, for reports
+};
+
+// Result of one optimized path against the reference
+struct PathReport
+{
+	static const uint32_t kMaxSamples = 8;
+
+	std::string name;
+	uint64_t rays = 0;
+	uint64_t edgeTies = 0;
+	uint64_t coincident = 0;         // another triangle at the same t away from edges: duplicate or overlapping faces
+	uint64_t hitMismatches = 0;      // hit against miss
+	uint64_t triangleMismatches = 0; // other object or triangle
+	uint64_t tMismatches = 0;
+	uint64_t uvMismatches = 0;
+	float maxTError = 0;
+	float maxUvError = 0;
+	std::vector<std::string> samples;
+
+	uint64_t Mismatches() const { return hitMismatches + triangleMismatches + tMismatches + uvMismatches; }
+
+	static std::string Describe(const RayHit &h)
+	{
+		char text[128];
+		if (h.object < 0) return "miss";
+		snprintf(text, sizeof(text), "object %d tri %u t %.7g uv (%.6f, %.6f)", h.object, h.triIndex, h.t, h.uv.x, h.uv.y);
+		return text;
+	}
+
+	void Compare(const ValidationRay &ray, const RayHit &reference, const RayHit &hit, const ValidationTolerance &tol)
+	{
+		rays++;
+		const char *kind = nullptr;
+		float scale = std::max(std::max(1.f, std::fabs(reference.t)), ray.orig.Length());
+		float dt = std::fabs(hit.t - reference.t) / scale;
+		float duv = std::max(std::fabs(hit.uv.x - reference.uv.x), std::fabs(hit.uv.y - reference.uv.y));
+		if (reference.object < 0 && hit.object < 0) return;
+		if (reference.object < 0 || hit.object < 0)
+		{
+			const RayHit &h = reference.object < 0 ? hit : reference;
+			if (h.EdgeDistance() < tol.edge) { edgeTies++; return; }
+			hitMismatches++;
+			kind = "hit/miss";
+		}
+		else if (reference.object != hit.object || reference.triIndex != hit.triIndex)
+		{
+			// the same point on two triangles is ambiguous, the reference just takes the first one
+			if (dt <= tol.t && std::min(reference.EdgeDistance(), hit.EdgeDistance()) < tol.edge) { edgeTies++; return; }
+			if (dt <= tol.t) { coincident++; return; }
+			triangleMismatches++;
+			kind = "triangle";
+		}
+		else
+		{
+			maxTError = std::max(maxTError, dt);
+			maxUvError = std::max(maxUvError, duv);
+			if (dt > tol.t) { tMismatches++; kind = "t"; }
+			else if (duv > tol.uv) { uvMismatches++; kind = "uv"; }
+			else return;
+		}
+		if (samples.size() < kMaxSamples)
+		{
+			char text[256];
+			snprintf(text, sizeof(text), "%s mismatch at %s: orig (%.7g, %.7g, %.7g) dir (%.7g, %.7g, %.7g)",
+				kind, ray.label.c_str(), ray.orig.x, ray.orig.y, ray.orig.z, ray.dir.x, ray.dir.y, ray.dir.z);
+			samples.push_back(std::string(text) + "\n      reference " + Describe(reference) + "\n      " + name + " " + Describe(hit));
+		}
+	}
+
+	void Print() const
+	{
+		fprintf(stderr, "%-14s %9llu rays  %6llu mismatches (hit %llu, triangle %llu, t %llu, uv %llu)  "
+			"%6llu edge ties  %6llu coincident  max dt %.3g  max duv %.3g\n",
+			name.c_str(), (unsigned long long)rays, (unsigned long long)Mismatches(),
+			(unsigned long long)hitMismatches, (unsigned long long)triangleMismatches,
+			(unsigned long long)tMismatches, (unsigned long long)uvMismatches,
+			(unsigned long long)edgeTies, (unsigned long long)coincident, maxTError, maxUvError);
+		for (const std::string &sample : samples)
+			fprintf(stderr, "    %s\n", sample.c_str());
+	}
+};
+
+// Differential check of the accelerated intersection paths against the original
+// brute force loop (TriangleMesh::IntersectLinear over every full detail triangle
+// in world space). Levels of detail are pinned to full detail so every path sees
+// the same geometry.
+class DifferentialValidator
+{
+	typedef std::function<RayHit(const Vec3f &, const Vec3f &)> TraceFn;
+
+	const std::vector<std::unique_ptr<Object>> &objects;
+	// full detail level of every object in world space, for the reference
+	std::vector<MeshLevel> worldLevels;
+
+public:
+	ValidationTolerance tolerance;
+	std::vector<PathReport> reports;
+
+	explicit DifferentialValidator(const std::vector<std::unique_ptr<Object>> &objs) : objects(objs)
+	{
+		for (const auto &object : objects)
+		{
+			object->SelectLevelOfDetail(Vec3f(0), 1, 0);
+			MeshLevel world;
+			const TriangleMesh *mesh = GetTriangleMesh(object.get());
+			// a plain mesh already is in world space, an instance holds it in object space
+			const Matrix4x4f o2w = object.get() == mesh ? Matrix4x4f() : object->objectToWorld;
+			if (mesh != nullptr && mesh->OutOfCore() == nullptr)
+			{
+				const MeshLevel &level = mesh->Levels()[0];
+				world.numTris = level.numTris;
+				world.numVerts = level.numVerts;
+				world.positions = std::unique_ptr<Vec3f[]>(new Vec3f[level.numVerts]);
+				world.indices = std::unique_ptr<uint32_t[]>(new uint32_t[level.numTris * 3]);
+				std::copy(level.indices.get(), level.indices.get() + level.numTris * 3, world.indices.get());
+				for (uint32_t i = 0; i < level.numVerts; ++i)
+					o2w.MultPointVec(level.positions[i], world.positions[i]);
+			}
+			else if (mesh != nullptr)
+			{
+				// read an out-of-core level back a triangle at a time, into source order
+				world.numTris = mesh->Levels()[0].numTris;
+				world.numVerts = world.numTris * 3;
+				world.positions = std::unique_ptr<Vec3f[]>(new Vec3f[world.numVerts]);
+				world.indices = std::unique_ptr<uint32_t[]>(new uint32_t[world.numTris * 3]);
+				for (uint32_t i = 0; i < world.numTris; ++i)
+				{
+					Vec3f p[3];
+					Vec2f st[3];
+					mesh->GetTriangleCornersLevel(0, i, p, st);
+					uint32_t tri = mesh->SourceTriangle(0, i);
+					for (uint32_t k = 0; k < 3; ++k)
+					{
+						o2w.MultPointVec(p[k], world.positions[tri * 3 + k]);
+						world.indices[tri * 3 + k] = tri * 3 + k;
+					}
+				}
+			}
+			worldLevels.push_back(std::move(world));
+		}
+	}
+
+	// The original Trace loop with the brute force mesh test
+	RayHit TraceReference(const Vec3f &orig, const Vec3f &dir) const
+	{
+		RayHit hit;
+		for (uint32_t k = 0; k < worldLevels.size(); ++k)
+		{
+			float tNear = kInfinity;
+			uint32_t triIndex;
+			Vec2f uv;
+			if (TriangleMesh::IntersectLinear(worldLevels[k], orig, dir, 0, tNear, triIndex, uv) && tNear < hit.t)
+			{
+				hit.object = k;
+				hit.t = tNear;
+				hit.triIndex = triIndex;
+				hit.uv = uv;
+			}
+		}
+		return hit;
+	}
+
+	RayHit MakeHit(Object *hitObject, float t, uint32_t index, const Vec2f &uv) const
+	{
+		RayHit hit;
+		if (hitObject == nullptr) return hit;
+		for (uint32_t k = 0; k < objects.size(); ++k)
+			if (objects[k].get() == hitObject) hit.object = k;
+		const TriangleMesh *mesh = GetTriangleMesh(hitObject);
+		hit.triIndex = mesh ? mesh->SourceTriangle(0, index) : index;
+		hit.t = t;
+		hit.uv = uv;
+		return hit;
+	}
+
+	// Trace through the objects as rendering does
+	RayHit TraceObjects(const Vec3f &orig, const Vec3f &dir) const
+	{
+		float tNear = kInfinity;
+		uint32_t index = 0;
+		Vec2f uv;
+		Object *hitObject = nullptr;
+		Trace(orig, dir, objects, tNear, index, uv, &hitObject);
+		return MakeHit(hitObject, tNear, index, uv);
+	}
+
+	// Trace through the objects in streams of kRayStreamSize rays
+	std::vector<RayHit> TraceObjectsStream(const std::vector<ValidationRay> &rays) const
+	{
+		std::vector<RayHit> result(rays.size());
+		for (size_t first = 0; first < rays.size(); first += kRayStreamSize)
+		{
+			RayStream stream;
+			stream.count = (uint32_t)std::min<size_t>(kRayStreamSize, rays.size() - first);
+			for (uint32_t i = 0; i < stream.count; ++i)
+				stream.Set(i, rays[first + i].orig, rays[first + i].dir);
+			RayHits hits;
+			Object *hitObject[kRayStreamSize];
+			Trace(stream, objects, hits, hitObject);
+			for (uint32_t i = 0; i < stream.count; ++i)
+				result[first + i] = MakeHit(hitObject[i], stream.tMax[i], hits.triIndex[i], Vec2f(hits.u[i], hits.v[i]));
+		}
+		return result;
+	}
+
+	// Compare one path over a set of rays. reference holds TraceReference of every ray.
+	// The returned report is valid until the next run.
+	PathReport& RunPath(const std::string &name, const std::vector<ValidationRay> &rays,
+		const std::vector<RayHit> &reference, TraceFn trace)
+	{
+		std::vector<RayHit> hits(rays.size());
+		for (size_t r = 0; r < rays.size(); ++r)
+			hits[r] = trace(rays[r].orig, rays[r].dir);
+		return RunPath(name, rays, reference, hits);
+	}
+
+	// Compare hits a path already computed for every ray
+	PathReport& RunPath(const std::string &name, const std::vector<ValidationRay> &rays,
+		const std::vector<RayHit> &reference, const std::vector<RayHit> &hits)
+	{
+		PathReport report;
+		report.name = name;
+		for (size_t r = 0; r < rays.size(); ++r)
+			report.Compare(rays[r], reference[r], hits[r], tolerance);
+		reports.push_back(report);
+		return reports.back();
+	}
+
+	std::vector<RayHit> TraceReference(const std::vector<ValidationRay> &rays) const
+	{
+		std::vector<RayHit> hits(rays.size());
+		for (size_t r = 0; r < rays.size(); ++r)
+			hits[r] = TraceReference(rays[r].orig, rays[r].dir);
+		return hits;
+	}
+
+	uint64_t Mismatches() const
+	{
+		uint64_t n = 0;
+		for (const PathReport &report : reports)
+			n += report.Mismatches();
+		return n;
+	}
+};
+
+// Move every mesh behind objects out of core with a small page cache
+inline void MoveMeshesOutOfCore(const std::vector<std::unique_ptr<Object>> &objects, const std::string &prefix, uint64_t budgetBytes)
+{
+	for (uint32_t i = 0; i < objects.size(); ++i)
+	{
+		TriangleMesh *mesh = GetTriangleMesh(objects[i].get());
+		if (mesh != nullptr && mesh->OutOfCore() == nullptr)
+			mesh->MoveOutOfCore(prefix + "." + std::to_string(i) + ".ooc", budgetBytes);
+	}
+}
+
+// Validate the camera rays of a frame through every path. Consumes the scene: its
+// meshes are moved out of core for the last path. Returns the number of mismatches.
+uint64_t ValidateScene(const Options &options, const std::vector<std::unique_ptr<Object>> &objects)
+{
+	DifferentialValidator validator(objects);
+	PrimaryRays camera(options);
+	std::vector<ValidationRay> rays, simdRays;
+	std::unique_ptr<Vec3f[]> dirs(new Vec3f[options.width]), simdDirs(new Vec3f[options.width]);
+	for (uint32_t j = 0; j < options.height; ++j)
+	{
+		float y = (1 - 2 * (j + 0.5) / (float)options.height) * camera.scale;
+		GenerateRayDirectionsGeneric(options.cameraToWorld, camera.xs.get(), y, options.width, dirs.get());
+		GenerateRayDirections(options.cameraToWorld, camera.xs.get(), y, options.width, simdDirs.get());
+		for (uint32_t i = 0; i < options.width; ++i)
+		{
+			std::string label = "pixel " + std::to_string(i) + "," + std::to_string(j);
+			rays.push_back(ValidationRay{ camera.orig, dirs[i], label });
+			simdRays.push_back(ValidationRay{ camera.orig, simdDirs[i], label });
+		}
+	}
+	fprintf(stderr, "Validating %u objects with %zu camera rays\n", (uint32_t)objects.size(), rays.size());
+	std::vector<RayHit> reference = validator.TraceReference(rays);
+
+	validator.RunPath("bvh", rays, reference, [&](const Vec3f &o, const Vec3f &d) { return validator.TraceObjects(o, d); }).Print();
+	validator.RunPath("stream", rays, reference, validator.TraceObjectsStream(rays)).Print();
+	// SIMD ray generation, measured with the reference intersector so only the rays differ
+	PathReport &simd = validator.RunPath("simd-rays", simdRays, reference,
+		[&](const Vec3f &o, const Vec3f &d) { return validator.TraceReference(o, d); });
+	simd.Print();
+	MoveMeshesOutOfCore(objects, options.outputName + ".validate", 16 * 1024);
+	validator.RunPath("out-of-core", rays, reference, [&](const Vec3f &o, const Vec3f &d) { return validator.TraceObjects(o, d); }).Print();
+	return validator.Mismatches();
+}
+
+// Random indexed triangles in a box, including long slivers
+inline TriangleMesh* GenerateTriangleSoup(std::mt19937 &rng, uint32_t numTris, float extent)
+{
+	std::uniform_real_distribution<float> coord(-extent, extent), unit(0, 1);
+	uint32_t numVerts = numTris * 3;
+	std::unique_ptr<uint32_t[]> faceIndex(new uint32_t[numTris]);
+	std::unique_ptr<uint32_t[]> vertsIndex(new uint32_t[numVerts]);
+	std::unique_ptr<Vec3f[]> verts(new Vec3f[numVerts]);
+	std::unique_ptr<Vec3f[]> normals(new Vec3f[numVerts]);
+	std::unique_ptr<Vec2f[]> st(new Vec2f[numVerts]);
+	for (uint32_t f = 0; f < numTris; ++f)
+	{
+		faceIndex[f] = 3;
+		Vec3f center(coord(rng), coord(rng), coord(rng));
+		float size = extent * 0.2f * unit(rng);
+		bool sliver = unit(rng) < 0.25f;
+		for (uint32_t k = 0; k < 3; ++k)
+		{
+			Vec3f offset(coord(rng), coord(rng), coord(rng));
+			// slivers get one long edge and almost no width
+			if (sliver && k == 2) offset = verts[f * 3 + 1] - center + Vec3f(coord(rng), coord(rng), coord(rng)) * 0.001f;
+			else offset *= size / extent;
+			vertsIndex[f * 3 + k] = f * 3 + k;
+			verts[f * 3 + k] = center + offset;
+			normals[f * 3 + k] = Vec3f(0, 0, 1);
+			st[f * 3 + k] = Vec2f(unit(rng), unit(rng));
+		}
+	}
+	return new TriangleMesh(Matrix4x4f(), numTris, faceIndex, vertsIndex, verts, normals, st);
+}
+
+// Randomized differential check: generated meshes (poly spheres and triangle soups,
+// some placed through instances) hit by random rays from inside and around them
+uint64_t ValidateFuzz(uint32_t iterations, uint32_t seed, uint32_t raysPerIteration = 4096)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> unit(0, 1), sym(-1, 1);
+	const uint32_t kNumPaths = 4;
+	PathReport total[kNumPaths];
+	const char *names[kNumPaths] = { "bvh", "instanced", "stream", "out-of-core" };
+	for (uint32_t p = 0; p < kNumPaths; ++p) total[p].name = names[p];
+	for (uint32_t it = 0; it < iterations; ++it)
+	{
+		std::vector<std::unique_ptr<Object>> objects;
+		uint32_t numObjects = 1 + rng() % 4;
+		const float extent = 20;
+		for (uint32_t k = 0; k < numObjects; ++k)
+		{
+			TriangleMesh *mesh;
+			if (rng() % 2)
+			{
+				Matrix4x4f m;
+				m[3][0] = sym(rng) * extent, m[3][1] = sym(rng) * extent, m[3][2] = sym(rng) * extent;
+				mesh = generatePolySphere(m, 0.5f + unit(rng) * extent * 0.5f, 2 + rng() % 24);
+			}
+			else mesh = GenerateTriangleSoup(rng, 1 + rng() % 600, extent);
+			if (rng() % 3 == 0)
+			{
+				// the same mesh rotated, scaled and moved through an instance
+				Matrix4x4f m;
+				float a = unit(rng) * 6.2831853f, s = 0.25f + unit(rng) * 2;
+				m[0][0] = cos(a) * s; m[0][2] = -sin(a) * s;
+				m[1][1] = s;
+				m[2][0] = sin(a) * s; m[2][2] = cos(a) * s;
+				m[3][0] = sym(rng) * extent, m[3][1] = sym(rng) * extent, m[3][2] = sym(rng) * extent;
+				objects.push_back(std::unique_ptr<Object>(new MeshInstance(std::shared_ptr<TriangleMesh>(mesh), m)));
+			}
+			else objects.push_back(std::unique_ptr<Object>(mesh));
+		}
+
+		DifferentialValidator validator(objects);
+		std::vector<ValidationRay> rays(raysPerIteration);
+		for (uint32_t r = 0; r < raysPerIteration; ++r)
+		{
+			rays[r].orig = Vec3f(sym(rng), sym(rng), sym(rng)) * (extent * 2);
+			Vec3f dir(sym(rng), sym(rng), sym(rng));
+			// axis aligned directions exercise the zero components of the slab test
+			if (r % 16 == 0) dir = Vec3f(0, 0, 0), dir[rng() % 3] = sym(rng) < 0 ? -1.f : 1.f;
+			rays[r].dir = dir.Length() > 0 ? dir.Normalize() : Vec3f(0, 0, 1);
+			rays[r].label = "seed " + std::to_string(seed) + " iteration " + std::to_string(it) + " ray " + std::to_string(r);
+		}
+		std::vector<RayHit> reference = validator.TraceReference(rays);
+		auto traceObjects = [&](const Vec3f &o, const Vec3f &d) { return validator.TraceObjects(o, d); };
+		// instanced and plain objects go through the same Trace, split the report by kind
+		std::vector<ValidationRay> plainRays, instancedRays;
+		std::vector<RayHit> plainReference, instancedReference;
+		for (size_t r = 0; r < rays.size(); ++r)
+		{
+			bool instanced = reference[r].object >= 0 && dynamic_cast<MeshInstance*>(objects[reference[r].object].get());
+			(instanced ? instancedRays : plainRays).push_back(rays[r]);
+			(instanced ? instancedReference : plainReference).push_back(reference[r]);
+		}
+		validator.RunPath("bvh", plainRays, plainReference, traceObjects);
+		validator.RunPath("instanced", instancedRays, instancedReference, traceObjects);
+		validator.RunPath("stream", rays, reference, validator.TraceObjectsStream(rays));
+		MoveMeshesOutOfCore(objects, "fuzz", 8 * 1024);
+		validator.RunPath("out-of-core", rays, reference, traceObjects);
+		for (uint32_t p = 0; p < kNumPaths; ++p)
+		{
+			PathReport &t = total[p], &run = validator.reports[p];
+			t.rays += run.rays;
+			t.edgeTies += run.edgeTies;
+			t.coincident += run.coincident;
+			t.hitMismatches += run.hitMismatches;
+			t.triangleMismatches += run.triangleMismatches;
+			t.tMismatches += run.tMismatches;
+			t.uvMismatches += run.uvMismatches;
+			t.maxTError = std::max(t.maxTError, run.maxTError);
+			t.maxUvError = std::max(t.maxUvError, run.maxUvError);
+			for (size_t i = 0; i < run.samples.size() && t.samples.size() < PathReport::kMaxSamples; ++i)
+				t.samples.push_back(run.samples[i]);
+		}
+	}
+	fprintf(stderr, "Fuzzed %u scenes (seed %u)\n", iterations, seed);
+	uint64_t mismatches = 0;
+	for (uint32_t p = 0; p < kNumPaths; ++p)
+	{
+		total[p].Print();
+		mismatches += total[p].Mismatches();
+	}
+	return mismatches;
+}
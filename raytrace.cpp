@@ -5,12 +5,21 @@
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "Benchmark.h"
 #include "Geometry.h"
+#include "IncrementalRender.h"
 #include "MathHeader.h"
+#include "MultiView.h"
 #include "Raytracer.h"
+#include "RenderServer.h"
+#include "Reprojection.h"
+#include "Scene.h"
+#include "SceneFile.h"
+#include "Validation.h"
 
 /* TODO LIST
 	Refactor Origin & Dir into Ray class?
@@ -25,18 +34,449 @@
 
 const int SEED = 24601;
 
-float random_float(float a, float b)
+// Move every triangle mesh of the scene into a mapped file behind a page cache. Kept
+// files can be used by scene files in place of the meshes they were written from.
+void MoveOutOfCore(const std::vector<std::unique_ptr<Object>> &objects, const std::string &prefix, uint64_t budgetBytes, bool keepFiles)
 {
-	float random = ((float)rand()) / (float)RAND_MAX;
-	float diff = b - a;
-	float r = random * diff;
-	return a + r;
+	for (uint32_t i = 0; i < objects.size(); ++i)
+	{
+		TriangleMesh *mesh = GetTriangleMesh(objects[i].get());
+		// instanced meshes only move once
+		if (mesh == nullptr || mesh->OutOfCore() != nullptr) continue;
+		std::string path = prefix + "." + std::to_string(i) + ".ooc";
+		if (!mesh->MoveOutOfCore(path, budgetBytes, keepFiles))
+			fprintf(stderr, "Failed to move mesh %u out of core (%s)\n", i, path.c_str());
+		else if (keepFiles)
+			fprintf(stderr, "Wrote mesh %u to %s\n", i, path.c_str());
+	}
 }
 
-int main()
+void PrintOutOfCoreStats(const std::vector<std::unique_ptr<Object>> &objects)
+{
+	for (uint32_t i = 0; i < objects.size(); ++i)
+	{
+		TriangleMesh *mesh = GetTriangleMesh(objects[i].get());
+		if (mesh == nullptr || mesh->OutOfCore() == nullptr) continue;
+		const OutOfCoreMesh *ooc = mesh->OutOfCore();
+		PageCacheStats stats = ooc->CacheStats();
+		fprintf(stderr, "Mesh %u out of core: %u levels, %llu triangles in a %llu byte file, %llu byte cache, %u resident nodes, "
+			"hit rate %.2f%%, %llu bytes faulted, %llu evictions\n",
+			i, ooc->NumLevels(), (unsigned long long)ooc->LevelInfo(0).numTris, (unsigned long long)ooc->FileSize(),
+			(unsigned long long)ooc->CacheBudget(), ooc->NumResidentNodes(),
+			100 * stats.HitRate(), (unsigned long long)stats.bytesFaulted, (unsigned long long)stats.evictions);
+	}
+}
+
+// Size the texture cache and bind the texture given on the command line to every
+// object without one
+bool SetUpTextures(const Options &options, const std::string &textureFile, const std::vector<std::unique_ptr<Object>> &objects)
+{
+	TextureCache::Get().SetBudget(options.textureCacheBytes);
+	if (textureFile.empty()) return true;
+	std::shared_ptr<Texture> texture(new Texture);
+	std::string error;
+	if (!texture->Load(textureFile, error))
+	{
+		fprintf(stderr, "Cannot load texture: %s\n", error.c_str());
+		return false;
+	}
+	for (const auto &object : objects)
+		if (!object->texture) object->texture = texture;
+	return true;
+}
+
+// Smallest page cache given to a mesh moved out of core to fit the memory budget
+static const uint64_t kMinBudgetCacheBytes = 64 * 1024;
+// Smallest texture cache left when shrinking it to fit the memory budget
+static const uint64_t kMinBudgetTextureCacheBytes = 256 * 1024;
+
+// Check what the render will hold against options.memoryBudget before it starts, so
+// an oversized job fails up front instead of being killed mid-frame. With
+// degradeOverBudget the scene is made smaller step by step until it fits: corner
+// normals are dropped, the band is kept in half floats, the largest meshes move out
+// of core, the texture cache shrinks, and finally their finest levels of detail are
+// dropped. Renders that keep the whole frame pass its size as wholeFrameBytes, 0 for a
+// banded render.
+bool EnforceMemoryBudget(Options &options, const std::vector<std::unique_ptr<Object>> &objects, uint64_t wholeFrameBytes)
+{
+	if (options.memoryBudget == 0) return true;
+	MemoryUsage usage;
+	auto fits = [&]() {
+		usage = SceneMemoryUsage(objects);
+		usage.framebuffer = wholeFrameBytes ? wholeFrameBytes : FramebufferBytes(options);
+		usage.textures = TextureCache::Get().ReservedBytes();
+		return usage.Total() <= options.memoryBudget;
+	};
+	if (fits()) return true;
+	fprintf(stderr, "Memory budget %.2f MB exceeded\n", Megabytes(options.memoryBudget));
+	PrintMemoryUsage("Required", usage);
+	if (!options.degradeOverBudget) return false;
+
+	// distinct meshes, largest first
+	std::vector<std::pair<uint64_t, TriangleMesh*>> meshes;
+	for (const auto &object : objects)
+	{
+		TriangleMesh *mesh = GetTriangleMesh(object.get());
+		if (mesh == nullptr) continue;
+		bool seen = false;
+		for (const auto &m : meshes)
+			seen = seen || m.second == mesh;
+		if (seen) continue;
+		MemoryUsage meshUsage;
+		mesh->GetMemoryUsage(meshUsage);
+		meshes.push_back(std::make_pair(meshUsage.Total(), mesh));
+	}
+	std::sort(meshes.begin(), meshes.end(), [](const std::pair<uint64_t, TriangleMesh*> &a, const std::pair<uint64_t, TriangleMesh*> &b) {
+		return a.first > b.first;
+	});
+	auto degraded = [&]() {
+		PrintMemoryUsage("Degraded to", usage);
+		return true;
+	};
+
+	uint64_t normalBytes = 0;
+	for (const auto &m : meshes)
+		normalBytes += m.second->DropNormals();
+	if (normalBytes > 0)
+		fprintf(stderr, "Dropped %.2f MB of corner normals\n", Megabytes(normalBytes));
+	if (fits()) return degraded();
+
+	if (wholeFrameBytes == 0 && !options.halfFloatBands)
+	{
+		options.halfFloatBands = true;
+		fprintf(stderr, "Keeping the band in half floats\n");
+		if (fits()) return degraded();
+	}
+
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		TriangleMesh *mesh = meshes[i].second;
+		if (mesh->OutOfCore() != nullptr) continue;
+		MemoryUsage meshUsage;
+		mesh->GetMemoryUsage(meshUsage);
+		// a cache of an eighth of the levels it replaces
+		uint64_t cacheBytes = std::max(kMinBudgetCacheBytes, meshUsage.Total() / 8);
+		if (cacheBytes >= meshUsage.Total()) continue;
+		std::string path = options.outputName + ".budget." + std::to_string(i) + ".ooc";
+		if (!mesh->MoveOutOfCore(path, cacheBytes)) continue;
+		fprintf(stderr, "Moved a mesh of %u triangles out of core (%.2f MB cache)\n",
+			mesh->Levels()[0].numTris, Megabytes(cacheBytes));
+		if (fits()) return degraded();
+	}
+
+	TextureCache &textureCache = TextureCache::Get();
+	if (usage.textures > kMinBudgetTextureCacheBytes)
+	{
+		uint64_t over = usage.Total() - options.memoryBudget;
+		uint64_t bytes = usage.textures > over ? usage.textures - over : 0;
+		textureCache.SetBudget(std::max(kMinBudgetTextureCacheBytes, bytes));
+		options.textureCacheBytes = textureCache.BudgetBytes();
+		fprintf(stderr, "Shrank the texture cache to %.2f MB\n", Megabytes(textureCache.BudgetBytes()));
+		if (fits()) return degraded();
+	}
+
+	for (const auto &m : meshes)
+	{
+		while (m.second->DropFinestLevel())
+		{
+			fprintf(stderr, "Dropped the finest level of detail of a mesh, now %u triangles\n", m.second->Levels()[0].numTris);
+			if (fits()) return degraded();
+		}
+	}
+	fprintf(stderr, "Cannot fit the memory budget\n");
+	PrintMemoryUsage("Degraded to", usage);
+	return false;
+}
+
+void PrintObjectMemory(const std::vector<std::unique_ptr<Object>> &objects)
+{
+	std::vector<MemoryUsage> perObject;
+	SceneMemoryUsage(objects, &perObject);
+	for (uint32_t i = 0; i < objects.size(); ++i)
+	{
+		const MemoryUsage &u = perObject[i];
+		fprintf(stderr, "Object %u: %.3f MB (geometry %.3f MB, BVH %.3f MB, page cache %.3f MB, object %llu bytes)\n",
+			i, Megabytes(u.Total()), Megabytes(u.Geometry()), Megabytes(u.bvh), Megabytes(u.pageCache), (unsigned long long)u.objects);
+	}
+}
+
+// Orbit the camera about the world y axis, rendering each frame with temporal reuse
+void RenderFlythrough(const Options &options, const std::vector<std::unique_ptr<Object>> &objects,
+	uint32_t numFrames, float degreesPerFrame)
+{
+	TemporalCache cache;
+	Options frameOptions = options;
+	auto timeStart = std::chrono::high_resolution_clock::now();
+	for (uint32_t frame = 0; frame < numFrames; ++frame)
+	{
+		float angle = deg2rad(degreesPerFrame * frame);
+		Matrix4x4f orbit;
+		orbit[0][0] = cos(angle); orbit[0][2] = -sin(angle);
+		orbit[2][0] = sin(angle); orbit[2][2] = cos(angle);
+		frameOptions.cameraToWorld = options.cameraToWorld * orbit;
+		cache.Render(frameOptions, objects, frame);
+	}
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+	double passedMs = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+	fprintf(stderr, "Flythrough: %u frames, %.2f ms per frame, reused %.1f%% of pixels, %.1f%% of surface pixels (max reuse age %u)\n",
+		numFrames, passedMs / std::max(1u, numFrames), 100 * cache.total.ReuseFraction(),
+		100 * cache.total.GeometryReuseFraction(), options.maxReuseAge);
+	MemoryUsage memory = SceneMemoryUsage(objects);
+	memory.framebuffer += TemporalCache::Bytes(options.width, options.height);
+	memory.textures += TextureCache::Get().ReservedBytes();
+	PrintMemoryUsage("Memory", memory);
+	PrintTextureCacheStats();
+}
+
+// Every triangle mesh of the scene once, however many instances share it
+std::vector<TriangleMesh*> DistinctMeshes(const std::vector<std::unique_ptr<Object>> &objects)
+{
+	std::vector<TriangleMesh*> meshes;
+	for (const auto &object : objects)
+	{
+		TriangleMesh *mesh = GetTriangleMesh(object.get());
+		if (mesh != nullptr && std::find(meshes.begin(), meshes.end(), mesh) == meshes.end())
+			meshes.push_back(mesh);
+	}
+	return meshes;
+}
+
+void RebuildBVHs(const std::vector<TriangleMesh*> &meshes, const BVHBuildOptions &bvhOptions)
+{
+	for (TriangleMesh *mesh : meshes)
+		mesh->RebuildBVHs(bvhOptions);
+}
+
+// Trace, without shading, the primary rays of a frame at the levels of detail options picks
+void TracePrimaryRays(const Options &options, const std::vector<std::unique_ptr<Object>> &objects)
+{
+	PrimaryRays rays(options);
+	uint64_t activeTris = 0, fullDetailTris = 0;
+	SelectLevelsOfDetail(options, rays, objects, activeTris, fullDetailTris);
+	uint32_t tilesPerRow = (options.width + kTileSize - 1) / kTileSize;
+	GetThreadPool(options.numThreads).ParallelFor(tilesPerRow * options.height, [&](uint32_t task, uint32_t) {
+		uint32_t j = task / tilesPerRow;
+		uint32_t x0 = (task % tilesPerRow) * kTileSize;
+		RayStream stream;
+		stream.count = std::min(kTileSize, options.width - x0);
+		Vec3f dirs[kTileSize];
+		rays.Generate(j, x0, stream.count, dirs);
+		for (uint32_t i = 0; i < stream.count; ++i)
+			stream.Set(i, rays.orig, dirs[i]);
+		RayHits hits;
+		Object *hitObject[kTileSize];
+		Trace(stream, objects, hits, hitObject);
+	});
+}
+
+// Milliseconds to trace the primary rays of a frame, best of a few runs
+double TimePrimaryRays(const Options &options, const std::vector<std::unique_ptr<Object>> &objects)
+{
+	return BestOfMilliseconds(5, [&]() { TracePrimaryRays(options, objects); });
+}
+
+// Trace the primary rays once at the levels of detail options picks and once at full
+// detail, and report the triangle tests per ray each made
+void CompareLevelsOfDetail(const Options &options, const std::vector<std::unique_ptr<Object>> &objects)
+{
+	Options fullOptions = options;
+	fullOptions.lodErrorThreshold = 0;
+	double numRays = double(uint64_t(options.width) * options.height);
+	TriangleTestCounter &counter = TriangleTestCounter::Get();
+	uint64_t start = counter.Total();
+	TracePrimaryRays(options, objects);
+	uint64_t lodTests = counter.Total() - start;
+	start = counter.Total();
+	TracePrimaryRays(fullOptions, objects);
+	uint64_t fullTests = counter.Total() - start;
+	fprintf(stderr, "Triangle tests per ray: %.2f with levels of detail (error threshold %.2f pixels), %.2f at full detail (%.1f%%)\n",
+		lodTests / numRays, options.lodErrorThreshold, fullTests / numRays, fullTests ? 100.0 * lodTests / fullTests : 100.0);
+}
+
+struct BVHBuildSummary
+{
+	double buildMs = 0;   // every level
+	double sahCost = 0;   // full detail levels, mean per mesh
+	uint64_t numTris = 0; // full detail levels from here on
+	uint64_t numRefs = 0;
+	uint64_t numNodes = 0;
+	uint64_t numSpatialSplits = 0;
+};
+
+BVHBuildSummary SummarizeBVHs(const std::vector<TriangleMesh*> &meshes)
+{
+	BVHBuildSummary summary;
+	uint32_t numMeshes = 0;
+	for (TriangleMesh *mesh : meshes)
+	{
+		// out-of-core meshes keep their block BVHs
+		if (mesh->OutOfCore()) continue;
+		const std::vector<MeshLevel> &levels = mesh->Levels();
+		for (const MeshLevel &level : levels)
+			summary.buildMs += level.bvh.stats.buildMs;
+		const BVH &bvh = levels[0].bvh;
+		summary.sahCost += bvh.SahCost();
+		summary.numTris += levels[0].numTris;
+		summary.numRefs += bvh.stats.numRefs;
+		summary.numNodes += bvh.stats.numNodes;
+		summary.numSpatialSplits += bvh.stats.numSpatialSplits;
+		numMeshes++;
+	}
+	if (numMeshes > 0) summary.sahCost /= numMeshes;
+	return summary;
+}
+
+// Build the BVHs of the scene with object splits only and then with spatial splits, and
+// report the modelled (SAH) and measured traversal cost and the build time of each.
+// The scene is left with the spatial split BVHs.
+void CompareBVHBuilds(const Options &options, const std::vector<std::unique_ptr<Object>> &objects, const BVHBuildOptions &bvhOptions)
+{
+	std::vector<TriangleMesh*> meshes = DistinctMeshes(objects);
+	BVHBuildOptions spatialOptions = bvhOptions;
+	spatialOptions.spatialSplits = true;
+	BVHBuildOptions objectOptions;
+	objectOptions.leafSize = spatialOptions.leafSize;
+	RebuildBVHs(meshes, objectOptions);
+	BVHBuildSummary object = SummarizeBVHs(meshes);
+	double objectTraceMs = TimePrimaryRays(options, objects);
+	RebuildBVHs(meshes, spatialOptions);
+	BVHBuildSummary spatial = SummarizeBVHs(meshes);
+	double spatialTraceMs = TimePrimaryRays(options, objects);
+
+	auto change = [](double from, double to) { return from > 0 ? 100 * (to - from) / from : 0; };
+	fprintf(stderr, "Object splits: %u meshes, %llu triangles, build %.2f ms, SAH cost %.2f, %llu nodes\n",
+		(uint32_t)meshes.size(), (unsigned long long)object.numTris, object.buildMs, object.sahCost, (unsigned long long)object.numNodes);
+	fprintf(stderr, "Spatial splits: build %.2f ms, SAH cost %.2f, %llu nodes, %llu references (+%.1f%%, budget %.0f%%), %llu spatial splits\n",
+		spatial.buildMs, spatial.sahCost, (unsigned long long)spatial.numNodes, (unsigned long long)spatial.numRefs,
+		change((double)spatial.numTris, (double)spatial.numRefs), 100 * spatialOptions.duplicationBudget,
+		(unsigned long long)spatial.numSpatialSplits);
+	fprintf(stderr, "Spatial against object splits: SAH cost %+.1f%%, primary rays traced in %.2f ms against %.2f ms (%+.1f%%), "
+		"build time %+.1f%%\n",
+		change(object.sahCost, spatial.sahCost), spatialTraceMs, objectTraceMs, change(objectTraceMs, spatialTraceMs),
+		change(object.buildMs, spatial.buildMs));
+}
+
+// Move one object per edit, cycling through the scene, and bring the frame up to date
+// incrementally after each. The last frame is checked against a full render.
+void RenderEditSequence(const Options &options, std::vector<std::unique_ptr<Object>> &objects, uint32_t numEdits)
+{
+	IncrementalRenderer renderer;
+	renderer.Render(options, objects, 0);
+	double fullMs = renderer.lastUpdate.ms;
+	double editMs = 0;
+	uint64_t retraced = 0, pixels = 0;
+	for (uint32_t edit = 1; edit <= numEdits && !objects.empty(); ++edit)
+	{
+		uint32_t k = (edit - 1) % objects.size();
+		MeshInstance *instance = dynamic_cast<MeshInstance*>(objects[k].get());
+		if (instance == nullptr)
+		{
+			// a plain mesh is moved through an instance of itself
+			TriangleMesh *mesh = dynamic_cast<TriangleMesh*>(objects[k].get());
+			if (mesh == nullptr) continue;
+			objects[k].release();
+			instance = new MeshInstance(std::shared_ptr<TriangleMesh>(mesh), Matrix4x4f());
+			instance->texture = mesh->texture;
+			objects[k].reset(instance);
+		}
+		// a tenth of the object's size along x, back and forth
+		Vec3f lo, hi;
+		float offset = instance->GetWorldBounds(lo, hi) ? (hi - lo).Length() * 0.1f : 1;
+		Matrix4x4f move;
+		move[3][0] = (edit / objects.size()) % 2 ? -offset : offset;
+		instance->SetObjectToWorld(instance->objectToWorld * move);
+		renderer.Update(options, objects, std::vector<uint32_t>(1, k), edit);
+		editMs += renderer.lastUpdate.ms;
+		retraced += renderer.lastUpdate.retraced;
+		pixels += renderer.lastUpdate.pixels;
+	}
+	if (numEdits == 0) return;
+
+	Options fullOptions = options;
+	fullOptions.outputName = options.outputName + ".full";
+	IncrementalRenderer full;
+	full.Render(fullOptions, objects, numEdits);
+	uint64_t differing = 0;
+	for (size_t p = 0; p < full.Colors().size(); ++p)
+		for (uint8_t c = 0; c < 3; ++c)
+			if (full.Colors()[p][c] != renderer.Colors()[p][c])
+			{
+				differing++;
+				break;
+			}
+	fprintf(stderr, "Edits: %u, %.2f ms per edit against %.2f ms for the full frame, retraced %.1f%% of pixels; "
+		"the last frame differs from a full render in %llu pixels\n",
+		numEdits, editMs / numEdits, fullMs, pixels ? 100.0 * retraced / pixels : 0, (unsigned long long)differing);
+	MemoryUsage memory = SceneMemoryUsage(objects);
+	memory.framebuffer += IncrementalRenderer::Bytes(options.width, options.height);
+	memory.textures += TextureCache::Get().ReservedBytes();
+	PrintMemoryUsage("Memory", memory);
+	PrintTextureCacheStats();
+}
+
+// Render a turntable of numViews views as one multi-view job, optionally against
+// rendering the same views one Render call after another
+void RenderTurntable(const Options &options, const std::vector<std::unique_ptr<Object>> &objects,
+	uint32_t numViews, bool sequentialBaseline)
+{
+	std::vector<ViewCamera> cameras = TurntableViews(options, numViews);
+	MultiViewRenderer renderer;
+	MultiViewStats stats = renderer.Render(options, cameras, objects);
+	fprintf(stderr, "Views: %u (%.1f Mpixels) in %.2f s, %.1f views per minute, %u threads, "
+		"at most %u bands resident (%.2f MB)%s\n",
+		stats.views, stats.pixels / 1e6, stats.ms / 1000, stats.ViewsPerMinute(), GetThreadPool(options.numThreads).NumThreads(),
+		stats.peakBands, Megabytes(stats.peakBandBytes), stats.failedViews ? ", some views failed to write" : "");
+	if (sequentialBaseline)
+	{
+		Options viewOptions = options;
+		viewOptions.outputName = options.outputName + ".sequential";
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		for (uint32_t v = 0; v < numViews; ++v)
+		{
+			viewOptions.cameraToWorld = cameras[v].cameraToWorld;
+			Render(viewOptions, objects, v);
+		}
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		double sequentialMs = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+		double sequentialRate = sequentialMs > 0 ? numViews * 60000.0 / sequentialMs : 0;
+		fprintf(stderr, "Sequential: %.2f s, %.1f views per minute; the multi-view job is %.2fx faster\n",
+			sequentialMs / 1000, sequentialRate, sequentialRate > 0 ? stats.ViewsPerMinute() / sequentialRate : 0);
+	}
+	MemoryUsage memory = SceneMemoryUsage(objects);
+	memory.framebuffer += stats.peakBandBytes;
+	memory.textures += TextureCache::Get().ReservedBytes();
+	PrintMemoryUsage("Memory", memory);
+	PrintTextureCacheStats();
+}
+
+// Framebuffer of the render modes that keep the whole frame, 0 for a banded render
+uint64_t WholeFrameBytes(const Options &options, uint32_t flythroughFrames, uint32_t numEdits)
+{
+	if (flythroughFrames > 0) return TemporalCache::Bytes(options.width, options.height);
+	if (numEdits > 0) return IncrementalRenderer::Bytes(options.width, options.height);
+	return 0;
+}
+
+// What to do with the scene, from the command line
+struct RunSettings
+{
+	uint64_t outOfCoreBudget = 0;
+	bool keepOutOfCoreFiles = false;
+	uint32_t flythroughFrames = 0;
+	uint32_t numEdits = 0;
+	uint32_t numViews = 0;
+	bool sequentialBaseline = false;
+	BVHBuildOptions bvhOptions;
+	bool compareBVHs = false;
+	bool compareLods = false;
+	bool validate = false;
+	bool memoryReport = false;
+	std::string textureFile;
+};
+
+// The built in scene, used when no scene file is given
+void SetUpDefaultScene(Options &options, std::vector<std::unique_ptr<Object>> &objects)
 {
-	srand(SEED);
-	Options options;
 	// Camera (View Matrix)
 	//Matrix4x4f tmp = Matrix4x4f(0.707107, -0.331295, 0.624695, 0, 0, 0.883452, 0.468521, 0, -0.707107, -0.331295, 0.624695, 0, -1.63871, -5.747777, -40.400412, 1);
 	Matrix4x4f tmp = Matrix4x4f(
@@ -47,30 +487,11 @@ int main()
 	options.cameraToWorld = tmp.Inverse();
 	options.fov = 50.0393;
 	
-	std::vector<std::unique_ptr<Object>> objects;
 	options.outputName = "sphere";
 
-	int numSpheres = 8;
-	int numDivisions = 6;
-	float positionVariance = 50.0f;
-	float minRadius = 0.1f;
-	float maxRadius = 10.0f;
-	for (int i = 0; i < numSpheres; ++i)
-	{
-		Matrix4x4f modelMatrix = Matrix4x4f();
-
-		Vec3f position = Vec3f(
-			random_float(-positionVariance, positionVariance), 
-			random_float(-positionVariance, positionVariance), 
-			random_float(-positionVariance, positionVariance)
-		);
-		float radius = random_float(minRadius, maxRadius);
-		modelMatrix.x[3][0] = position.x;
-		modelMatrix.x[3][1] = position.y;
-		modelMatrix.x[3][2] = position.z;
-		//modelMatrix = modelMatrix.Translate(modelMatrix, position);
-		objects.push_back(std::unique_ptr<Object>(generatePolySphere(modelMatrix, radius, numDivisions)));
-	}
+	SphereSceneParams sphereParams;
+	sphereParams.seed = SEED;
+	GenerateSphereScene(sphereParams, objects);
 
 	// Cow
 	//Matrix4x4f cowMat = Matrix4x4f();
@@ -78,8 +499,164 @@ int main()
 
 	//options.outputName = "cow";
 	//objects.push_back(std::unique_ptr<Object>(cow));
+}
 
-	Render(options, objects, 0);
+// Validate, benchmark or render the scene as the settings ask, returns the exit code
+int RunScene(Options &options, std::vector<std::unique_ptr<Object>> &objects, const RunSettings &settings)
+{
+	if (settings.compareBVHs)
+	{
+		CompareBVHBuilds(options, objects, settings.bvhOptions);
+		return 0;
+	}
+	if (settings.compareLods)
+	{
+		CompareLevelsOfDetail(options, objects);
+		return 0;
+	}
+	if (settings.bvhOptions.spatialSplits)
+		RebuildBVHs(DistinctMeshes(objects), settings.bvhOptions);
+	if (settings.validate)
+		return ValidateScene(options, objects) ? 1 : 0;
+	if (settings.outOfCoreBudget > 0)
+		MoveOutOfCore(objects, options.outputName, settings.outOfCoreBudget, settings.keepOutOfCoreFiles);
+	if (!SetUpTextures(options, settings.textureFile, objects) ||
+		!EnforceMemoryBudget(options, objects, WholeFrameBytes(options, settings.flythroughFrames, settings.numEdits)))
+		return 1;
 
+	if (settings.flythroughFrames > 0)
+		RenderFlythrough(options, objects, settings.flythroughFrames, 0.5f);
+	else if (settings.numEdits > 0)
+		RenderEditSequence(options, objects, settings.numEdits);
+	else if (settings.numViews > 0)
+		RenderTurntable(options, objects, settings.numViews, settings.sequentialBaseline);
+	else
+		Render(options, objects, 0);
+	PrintOutOfCoreStats(objects);
+	if (settings.memoryReport)
+		PrintObjectMemory(objects);
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	RunSettings settings;
+	bool server = false;
+	std::string sceneFile, profileFile;
+	std::vector<std::unique_ptr<Object>> objects;
+	// the scene file comes first, command line options override it
+	for (int i = 1; i + 1 < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--scene")
+			sceneFile = argv[++i];
+		else if (arg == "--profile")
+			profileFile = argv[++i];
+	}
+	// Chrome trace-event JSON of the whole run, written on exit
+	ChromeTraceSession profile(profileFile);
+	if (!sceneFile.empty())
+	{
+		Scene scene;
+		SceneLoadStats stats;
+		std::string error;
+		if (!LoadSceneFile(sceneFile, options, options, scene, stats, error))
+		{
+			fprintf(stderr, "Cannot load scene %s: %s\n", sceneFile.c_str(), error.c_str());
+			return 1;
+		}
+		objects = std::move(scene.objects);
+		fprintf(stderr, "Scene %s: %u objects, %s in %.2f ms (parse %.2f ms)\n", sceneFile.c_str(), (uint32_t)objects.size(),
+			stats.fromCache ? "loaded from cache" : "built", stats.buildMs, stats.parseMs);
+	}
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--bench-math")
+		{
+			RunMathBenchmarks();
+			return 0;
+		}
+		else if (arg == "--validate-fuzz" && i + 1 < argc)
+		{
+			// iterations [seed]
+			uint32_t iterations = std::stoul(argv[++i]);
+			uint32_t seed = i + 1 < argc && argv[i + 1][0] != '-' ? std::stoul(argv[++i]) : SEED;
+			return ValidateFuzz(iterations, seed) ? 1 : 0;
+		}
+		else if (arg == "--validate")
+			settings.validate = true;
+		else if (arg == "--out-of-core" && i + 1 < argc)
+		{
+			// page cache budget in KB
+			settings.outOfCoreBudget = std::stoull(argv[++i]) * 1024;
+		}
+		else if (arg == "--keep-ooc")
+			settings.keepOutOfCoreFiles = true;
+		else if (arg == "--threads" && i + 1 < argc)
+			options.numThreads = std::stoul(argv[++i]);
+		else if (arg == "--band-height" && i + 1 < argc)
+			options.bandHeight = std::stoul(argv[++i]);
+		else if (arg == "--half-float")
+			options.halfFloatBands = true;
+		else if (arg == "--server")
+			server = true;
+		else if (arg == "--flythrough" && i + 1 < argc)
+			settings.flythroughFrames = std::stoul(argv[++i]);
+		else if (arg == "--edit" && i + 1 < argc)
+			settings.numEdits = std::stoul(argv[++i]);
+		else if (arg == "--views" && i + 1 < argc)
+			settings.numViews = std::stoul(argv[++i]);
+		else if (arg == "--views-baseline")
+			settings.sequentialBaseline = true;
+		else if (arg == "--sbvh")
+			settings.bvhOptions.spatialSplits = true;
+		else if (arg == "--sbvh-budget" && i + 1 < argc)
+		{
+			// extra triangle references spatial splits may add, in percent of the triangles
+			settings.bvhOptions.duplicationBudget = std::stof(argv[++i]) / 100;
+		}
+		else if (arg == "--bvh-compare")
+			settings.compareBVHs = true;
+		else if (arg == "--lod-compare")
+			settings.compareLods = true;
+		else if (arg == "--lod" && i + 1 < argc)
+		{
+			// largest screen space error of a level of detail in pixels, 0 disables LOD
+			options.lodErrorThreshold = std::stof(argv[++i]);
+		}
+		else if (arg == "--max-reuse-age" && i + 1 < argc)
+			options.maxReuseAge = std::stoul(argv[++i]);
+		else if (arg == "--memory-budget" && i + 1 < argc)
+		{
+			// MB, fails over budget unless --memory-degrade is given
+			options.memoryBudget = uint64_t(std::stod(argv[++i]) * 1024 * 1024);
+		}
+		else if (arg == "--memory-degrade")
+			options.degradeOverBudget = true;
+		else if (arg == "--memory-report")
+			settings.memoryReport = true;
+		else if (arg == "--texture" && i + 1 < argc)
+		{
+			// bound to every object without a texture from the scene file
+			settings.textureFile = argv[++i];
+		}
+		else if (arg == "--texture-cache" && i + 1 < argc)
+			options.textureCacheBytes = std::stoull(argv[++i]) * 1024;
+		else if (arg == "--scene" || arg == "--profile")
+			++i;
+	}
+
+	if (server)
+	{
+		// render jobs from stdin, see RenderJob for the format
+		RenderServer renderServer(options);
+		renderServer.Run(std::cin);
+		return 0;
+	}
+
+	if (sceneFile.empty())
+		SetUpDefaultScene(options, objects);
+	return RunScene(options, objects, settings);
+}